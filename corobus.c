@@ -4,8 +4,11 @@
 #include "utils/rlist.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 struct data_vector
 {
@@ -21,6 +24,9 @@ static void
 data_vector_append_many(struct data_vector *vector,
 						const unsigned *data, size_t count)
 {
+	/* The data can be NULL then, and so can be the vector. */
+	if (count == 0)
+		return;
 	if (vector->size + count > vector->capacity)
 	{
 		if (vector->capacity == 0)
@@ -36,11 +42,18 @@ data_vector_append_many(struct data_vector *vector,
 	vector->size += count;
 }
 
-/** Append a single message to the vector. */
+/** Insert @a count messages in @a data before the head of the vector. */
 static void
-data_vector_append(struct data_vector *vector, unsigned data)
+data_vector_prepend_many(struct data_vector *vector,
+						 const unsigned *data, size_t count)
 {
-	data_vector_append_many(vector, &data, 1);
+	if (count == 0)
+		return;
+	size_t size = vector->size;
+	/* Grow like on append, then move the old messages back. */
+	data_vector_append_many(vector, data, count);
+	memmove(&vector->data[count], vector->data, size * sizeof(vector->data[0]));
+	memcpy(vector->data, data, sizeof(data[0]) * count);
 }
 
 /** Pop @a count of messages into @a data from the head of the vector. */
@@ -53,6 +66,36 @@ data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t co
 	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
 }
 
+/** Give back the memory beyond @a capacity, but keep the messages. */
+static void
+data_vector_shrink(struct data_vector *vector, size_t capacity)
+{
+	if (capacity < vector->size)
+		capacity = vector->size;
+	if (capacity >= vector->capacity)
+		return;
+	if (capacity == 0)
+	{
+		free(vector->data);
+		vector->data = NULL;
+	}
+	else
+	{
+		vector->data = realloc(vector->data,
+							   sizeof(vector->data[0]) * capacity);
+	}
+	vector->capacity = capacity;
+}
+
+/** Delete @a count of messages from the head of the vector. */
+static void
+data_vector_drop_first(struct data_vector *vector, size_t count)
+{
+	assert(count <= vector->size);
+	vector->size -= count;
+	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+}
+
 /** Pop a single message from the head of the vector. */
 static unsigned
 data_vector_pop_first(struct data_vector *vector)
@@ -62,6 +105,54 @@ data_vector_pop_first(struct data_vector *vector)
 	return data;
 }
 
+/** Vector of timestamps. */
+struct time_vector
+{
+	uint64_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+/** Append @a count copies of @a value to the end of the vector. */
+static void
+time_vector_append(struct time_vector *vector, uint64_t value, size_t count)
+{
+	if (vector->size + count > vector->capacity)
+	{
+		if (vector->capacity == 0)
+			vector->capacity = 4;
+		else
+			vector->capacity *= 2;
+		if (vector->capacity < vector->size + count)
+			vector->capacity = vector->size + count;
+		vector->data = realloc(vector->data,
+							   sizeof(vector->data[0]) * vector->capacity);
+	}
+	for (size_t i = 0; i < count; ++i)
+		vector->data[vector->size + i] = value;
+	vector->size += count;
+}
+
+/** Insert @a count copies of @a value before the head of the vector. */
+static void
+time_vector_prepend(struct time_vector *vector, uint64_t value, size_t count)
+{
+	size_t size = vector->size;
+	time_vector_append(vector, value, count);
+	memmove(&vector->data[count], vector->data, size * sizeof(vector->data[0]));
+	for (size_t i = 0; i < count; ++i)
+		vector->data[i] = value;
+}
+
+/** Delete @a count of timestamps from the head of the vector. */
+static void
+time_vector_drop_first(struct time_vector *vector, size_t count)
+{
+	assert(count <= vector->size);
+	vector->size -= count;
+	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+}
+
 #endif
 
 /**
@@ -78,19 +169,89 @@ struct wakeup_entry
 struct wakeup_queue
 {
 	struct rlist coros;
+	/** Number of coros in the queue. */
+	size_t count;
 };
 
 #if 1
 
-/** Suspend the current coroutine until it is woken up. */
 static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+wakeup_queue_create(struct wakeup_queue *queue)
+{
+	rlist_create(&queue->coros);
+	queue->count = 0;
+}
+
+/**
+ * Suspend the current coroutine until it is woken up or the
+ * deadline comes. UINT64_MAX means no deadline.
+ */
+static void
+wakeup_queue_suspend_this_until(struct wakeup_queue *queue,
+								uint64_t deadline)
 {
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
 	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	rlist_del_entry(&entry, base);
+	++queue->count;
+	coro_suspend_until(deadline);
+	/*
+	 * The entry could be already taken out of the queue by the
+	 * channel deletion. Then the queue might be freed already.
+	 */
+	if (!rlist_empty(&entry.base))
+	{
+		rlist_del_entry(&entry, base);
+		--queue->count;
+	}
+}
+
+/** Suspend the current coroutine until it is woken up. */
+static void
+wakeup_queue_suspend_this(struct wakeup_queue *queue)
+{
+	wakeup_queue_suspend_this_until(queue, UINT64_MAX);
+}
+
+/**
+ * How many queues a wait on any of them keeps its entries for on
+ * the stack. Longer lists of queues take them from the heap.
+ */
+enum
+{
+	CORO_BUS_WAIT_ANY_LOCAL = 8,
+};
+
+/**
+ * Suspend the current coroutine until it is woken up from any of
+ * the given queues or the deadline comes. UINT64_MAX means no
+ * deadline.
+ */
+static void
+wakeup_queue_suspend_this_any(struct wakeup_queue **queues, size_t count,
+							  uint64_t deadline)
+{
+	/* Most waits are on a few queues, they need no heap. */
+	struct wakeup_entry local[CORO_BUS_WAIT_ANY_LOCAL];
+	struct wakeup_entry *entries = local;
+	if (count > CORO_BUS_WAIT_ANY_LOCAL)
+		entries = malloc(count * sizeof(entries[0]));
+	for (size_t i = 0; i < count; ++i)
+	{
+		entries[i].coro = coro_this();
+		rlist_add_tail_entry(&queues[i]->coros, &entries[i], base);
+		++queues[i]->count;
+	}
+	coro_suspend_until(deadline);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (rlist_empty(&entries[i].base))
+			continue;
+		rlist_del_entry(&entries[i], base);
+		--queues[i]->count;
+	}
+	if (entries != local)
+		free(entries);
 }
 
 /** Instead of this function you can write this construction in the code
@@ -112,6 +273,19 @@ wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 	coro_wakeup(entry->coro);
 }
 
+/** Wakeup up to @a count first coroutines in the queue. */
+static void
+wakeup_queue_wakeup_n(struct wakeup_queue *queue, size_t count)
+{
+	struct rlist *head = &queue->coros;
+	for (struct rlist *it = head->next; it != head && count > 0;
+		 it = it->next, --count)
+	{
+		struct wakeup_entry *e = rlist_entry(it, struct wakeup_entry, base);
+		coro_wakeup(e->coro);
+	}
+}
+
 static void wakeup_queue_wakeup_all(struct wakeup_queue *q) {
     struct rlist *head = &q->coros;
     for (struct rlist *it = head->next; it != head; it = it->next) {
@@ -122,491 +296,4490 @@ static void wakeup_queue_wakeup_all(struct wakeup_queue *q) {
 
 #endif
 
-struct coro_bus_channel
+struct match_key;
+
+/** One key in the key index. */
+struct key_index_entry
 {
-	/** Channel max capacity. */
-	size_t size_limit;
-	/** Coroutines waiting until the channel is not full. */
-	struct wakeup_queue send_queue;
-	/** Coroutines waiting until the channel is not empty. */
-	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	struct data_vector data;
+	unsigned key;
+	bool is_used;
+	union
+	{
+		/** Sequence number of the message having this key. */
+		uint64_t seq;
+		/** Messages and receivers of the key in a matching channel. */
+		struct match_key *match;
+	};
 };
 
-struct coro_bus
+/**
+ * Hash table from a message key to the message sequence number.
+ * Open addressing with linear probing.
+ */
+struct key_index
 {
-	struct coro_bus_channel **channels;
-	int channel_count;
-	struct wakeup_queue broadcast_queue;
+	struct key_index_entry *entries;
+	/** Number of used entries. */
+	size_t count;
+	/** Log2 of the table size. 0 if not allocated. */
+	unsigned bits;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
-
-enum coro_bus_error_code
-coro_bus_errno(void)
-{
-	return global_error;
-}
+#if 1
 
-void coro_bus_errno_set(enum coro_bus_error_code err)
+static size_t
+key_index_slot(const struct key_index *index, unsigned key)
 {
-	global_error = err;
+	/* Fibonacci hashing, takes the best mixed high bits. */
+	return (uint32_t)(key * 2654435769u) >> (32 - index->bits);
 }
 
-struct coro_bus *
-coro_bus_new(void)
+/** Find the entry of the key. NULL if there is none. */
+static struct key_index_entry *
+key_index_find(struct key_index *index, unsigned key)
 {
-	struct coro_bus *bus = malloc(sizeof(*bus));
-	if (!bus)
+	if (index->count == 0)
 		return NULL;
-
-	bus->channels = NULL;
-	bus->channel_count = 0;
-	rlist_create(&bus->broadcast_queue.coros);
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return bus;
+	size_t mask = ((size_t)1 << index->bits) - 1;
+	for (size_t i = key_index_slot(index, key);; i = (i + 1) & mask)
+	{
+		struct key_index_entry *e = &index->entries[i];
+		if (!e->is_used)
+			return NULL;
+		if (e->key == key)
+			return e;
+	}
 }
 
-void coro_bus_delete(struct coro_bus *bus)
-{
-	if (bus == NULL)
-		return;
+static struct key_index_entry *
+key_index_insert(struct key_index *index, unsigned key, uint64_t seq);
 
-	/* 1) wake up all broadcast waiting coros */
-	while (!rlist_empty(&bus->broadcast_queue.coros))
+/** Double the table size and put all the entries again. */
+static void
+key_index_grow(struct key_index *index)
+{
+	struct key_index old = *index;
+	index->bits = old.bits == 0 ? 4 : old.bits + 1;
+	index->entries = calloc((size_t)1 << index->bits, sizeof(index->entries[0]));
+	index->count = 0;
+	for (size_t i = 0; old.bits != 0 && i < ((size_t)1 << old.bits); ++i)
 	{
-		struct wakeup_entry *e = rlist_shift_entry(
-			&bus->broadcast_queue.coros,
-			struct wakeup_entry, base);
-		coro_wakeup(e->coro);
+		if (old.entries[i].is_used)
+			*key_index_insert(index, old.entries[i].key, 0) = old.entries[i];
 	}
+	free(old.entries);
+}
 
-	/* 2) wake up all send/recv for all channels */
-	for (int i = 0; i < bus->channel_count; ++i)
+/** Add a key. It must not be in the index yet. */
+static struct key_index_entry *
+key_index_insert(struct key_index *index, unsigned key, uint64_t seq)
+{
+	/* Keep the load factor not bigger than 1/2. */
+	if ((index->count + 1) * 2 > ((size_t)1 << index->bits))
+		key_index_grow(index);
+	size_t mask = ((size_t)1 << index->bits) - 1;
+	size_t i = key_index_slot(index, key);
+	while (index->entries[i].is_used)
+		i = (i + 1) & mask;
+	index->entries[i].key = key;
+	index->entries[i].is_used = true;
+	index->entries[i].seq = seq;
+	++index->count;
+	return &index->entries[i];
+}
+
+/**
+ * Delete the entry. The entries after it are shifted back to
+ * keep the probe sequences without holes.
+ */
+static void
+key_index_delete(struct key_index *index, struct key_index_entry *entry)
+{
+	size_t mask = ((size_t)1 << index->bits) - 1;
+	size_t i = entry - index->entries;
+	size_t j = i;
+	while (true)
 	{
-		struct coro_bus_channel *chan = bus->channels[i];
-		if (!chan)
+		j = (j + 1) & mask;
+		struct key_index_entry *e = &index->entries[j];
+		if (!e->is_used)
+			break;
+		size_t home = key_index_slot(index, e->key);
+		/* Can move only if the home slot is not in (i, j]. */
+		bool stays = i <= j ? (i < home && home <= j) :
+							  (i < home || home <= j);
+		if (stays)
 			continue;
-
-		while (!rlist_empty(&chan->send_queue.coros))
-		{
-			struct wakeup_entry *e = rlist_shift_entry(
-				&chan->send_queue.coros,
-				struct wakeup_entry, base);
-			coro_wakeup(e->coro);
-		}
-		while (!rlist_empty(&chan->recv_queue.coros))
-		{
-			struct wakeup_entry *e = rlist_shift_entry(
-				&chan->recv_queue.coros,
-				struct wakeup_entry, base);
-			coro_wakeup(e->coro);
-		}
-
-		free(chan->data.data);
-		free(chan);
+		index->entries[i] = *e;
+		i = j;
 	}
+	index->entries[i].is_used = false;
+	--index->count;
+}
 
-	free(bus->channels);
-	free(bus);
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+static void
+key_index_clear(struct key_index *index)
+{
+	if (index->count == 0)
+		return;
+	memset(index->entries, 0, sizeof(index->entries[0]) << index->bits);
+	index->count = 0;
 }
 
-int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+static void
+key_index_destroy(struct key_index *index)
 {
-	if (bus == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
+	free(index->entries);
+	index->entries = NULL;
+	index->count = 0;
+	index->bits = 0;
+}
 
-	struct coro_bus_channel *chan = malloc(sizeof(*chan));
-	if (chan == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		return -1;
-	}
+#endif
 
-	chan->size_limit = size_limit;
-	rlist_create(&chan->recv_queue.coros);
-	rlist_create(&chan->send_queue.coros);
-	chan->data.data = NULL;
-	chan->data.size = 0;
-	chan->data.capacity = 0;
+/**
+ * How many channel operations make one window of the adaptive
+ * size limit. After each window the limit might be changed.
+ */
+enum
+{
+	CORO_BUS_ADAPT_WINDOW = 64,
+};
 
-	int id = 0;
-	for (id = 0; id < bus->channel_count; ++id)
-	{
-		if (bus->channels[id] == NULL)
-		{
-			bus->channels[id] = chan;
-			break;
-		}
-	}
+/**
+ * Full channels with expiring messages are swept not more often
+ * than once per this number of microseconds.
+ */
+enum
+{
+	CORO_BUS_SWEEP_PERIOD = 1000,
+};
 
-	if (id == bus->channel_count)
+/**
+ * Cost of one message in the token bucket. A bucket refilling at
+ * R messages per second gains R units per microsecond.
+ */
+enum
+{
+	CORO_BUS_TOKEN = 1000000,
+};
+
+/**
+ * Aggregation of the messages sent to a channel. Instead of the
+ * messages the channel gets one summary per window.
+ */
+struct channel_window
+{
+	enum coro_bus_window_op op;
+	/** Messages per window, 0 if the window is by time. */
+	size_t size;
+	/** Messages between summaries of a sliding window. */
+	size_t slide;
+	/** Length of a window by time. */
+	uint64_t period;
+	/** Summary of the current tumbling window. */
+	unsigned acc;
+	/** Messages in the current tumbling window. */
+	size_t count;
+	/** When the current window by time ends. */
+	uint64_t deadline;
+	/** Last size messages of a sliding window, by their number. */
+	unsigned *ring;
+	/** Total messages seen by a sliding window. */
+	uint64_t seen;
+	/** Sum of the messages in the ring. */
+	unsigned sum;
+	/**
+	 * Candidates for min or max of a sliding window, monotonic
+	 * in value. A cyclic buffer of size entries.
+	 */
+	struct window_candidate
 	{
-		int new_count = bus->channel_count + 1;
-		bus->channels = realloc(bus->channels, new_count * sizeof(*bus->channels));
-		bus->channels[bus->channel_count] = chan;
-		id = bus->channel_count;
-		bus->channel_count = new_count;
-	}
+		uint64_t seq;
+		unsigned value;
+	} *deque;
+	size_t deque_head;
+	size_t deque_len;
+	/** The summary is being pushed, it must not be aggregated. */
+	bool is_emitting;
+};
 
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return id;
-}
+/** A message received in the ack mode and not acknowledged yet. */
+struct ack_entry
+{
+	uint64_t tag;
+	/** When the message is delivered again if not acknowledged. */
+	uint64_t deadline;
+	/** Coroutine which has received the message. */
+	struct coro *owner;
+	unsigned data;
+	/** Acknowledged or given back, waits to be cleaned out. */
+	bool is_done;
+};
 
-void coro_bus_channel_close(struct coro_bus *bus, int channel)
+/** Messages in flight, ordered by their tags. */
+struct ack_vector
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return;
-	}
+	struct ack_entry *data;
+	size_t size;
+	size_t capacity;
+};
 
-	struct coro_bus_channel *chan = bus->channels[channel];
-	bus->channels[channel] = NULL;
+/**
+ * Filter of the recently sent keys. Remembers the last size
+ * different keys accepted by the channel in the order of their
+ * arrival, and the index tells if a key is among them.
+ */
+struct channel_dedup
+{
+	unsigned *ring;
+	size_t size;
+	/** Number of the keys in the ring. */
+	size_t count;
+	/** Where the next key goes, over the oldest one when full. */
+	size_t pos;
+	struct key_index index;
+	/** The messages are being pushed after the filter. */
+	bool is_passing;
+};
 
-	/* 1) Wake up all coroutines waiting for send with error NO_CHANNEL */
-	while (!rlist_empty(&chan->send_queue.coros))
-	{
+struct coro_bus_channel
+{
+	/** Bus the channel belongs to. */
+	struct coro_bus *bus;
+	/** Channel max capacity. */
+	size_t size_limit;
+	/** What to do with the messages which don't fit. */
+	enum coro_bus_overflow overflow;
+	/** How many messages were lost due to the overflow. */
+	size_t dropped;
+	/** Coroutines waiting until the channel is not full. */
+	struct wakeup_queue send_queue;
+	/** Coroutines waiting until the channel is not empty. */
+	struct wakeup_queue recv_queue;
+	/** Message queue. */
+	struct data_vector data;
+	/** Count of pending messages in all the queues. */
+	size_t size;
+	/**
+	 * Priority channel has a message queue per priority level
+	 * instead of the single data queue. Level 0 is the highest.
+	 */
+	struct data_vector *levels;
+	unsigned level_count;
+	/** Weighted dequeue instead of the strict priority order. */
+	bool is_weighted;
+	/** How many messages a level can take per weighted round. */
+	unsigned level_weights[CORO_BUS_PRIO_MAX];
+	/** How many messages a level can still take in this round. */
+	unsigned level_credits[CORO_BUS_PRIO_MAX];
+	/** How many messages were ever taken out of the queue. */
+	uint64_t popped;
+	/**
+	 * Conflating channel keeps only the latest message for each
+	 * key. Then the keys of the messages are stored in a vector
+	 * parallel to the data, and the index points at the pending
+	 * message of each key.
+	 */
+	bool is_conflating;
+	struct data_vector keys;
+	struct key_index index;
+	/** How many messages were replaced by newer ones with same key. */
+	size_t conflated;
+	/**
+	 * Matching channel keeps the keys too, and the index points at
+	 * the messages and the receivers of each key. Each message gets
+	 * a sequence number, kept parallel to the data, to find it by.
+	 */
+	bool is_matching;
+	struct time_vector seqs;
+	/** Sequence number of the next message of the matching channel. */
+	uint64_t next_seq;
+	/** Unused key records, kept for reuse. */
+	struct match_key *match_pool;
+	/** Number of receivers waiting for a message with a certain key. */
+	size_t match_waiters;
+	/**
+	 * Expiration times of the messages, parallel to the data.
+	 * Only kept when the channel has seen TTL.
+	 */
+	bool has_deadlines;
+	struct time_vector deadlines;
+	/** Default time to live of the messages, 0 if infinite. */
+	uint64_t ttl;
+	/** When the full channel can be swept for expired messages again. */
+	uint64_t next_sweep;
+	/** How many messages expired before being received. */
+	size_t expired;
+	/** The biggest size the message queue ever had. */
+	size_t high_watermark;
+	/** Coroutines waiting to send a whole batch at once. */
+	struct wakeup_queue atomic_queue;
+	/**
+	 * Atomic sender owning the reservation. Other senders can
+	 * only use the space left beyond the reserved messages, so
+	 * the big batch is not starved by small ones.
+	 */
+	struct coro *reserve_owner;
+	/** How many messages are reserved for the owner. */
+	size_t reserved;
+	/** Total count of times a sender was suspended on the channel. */
+	size_t send_blocks;
+	/** Total count of times a receiver was suspended on the channel. */
+	size_t recv_blocks;
+	/**
+	 * Bounds of the adaptive size limit. If the max is 0, then
+	 * the limit is fixed.
+	 */
+	size_t adapt_min;
+	size_t adapt_max;
+	/** Sends and receives done in the current adaptation window. */
+	unsigned window_ops;
+	/** Blocked senders in the current adaptation window. */
+	unsigned window_send_blocks;
+	/** Blocked receivers in the current adaptation window. */
+	unsigned window_recv_blocks;
+	/** The biggest size of the channel in the current window. */
+	size_t window_peak;
+	/** Delayed messages waiting to be delivered to the channel. */
+	struct rlist timers;
+	size_t delayed;
+	/** Pipeline taking credits on sends to this channel. */
+	struct coro_bus_pipeline *head_of;
+	/** Pipeline getting credits back on receives from this channel. */
+	struct coro_bus_pipeline *tail_of;
+	/**
+	 * Channel where the messages sent to this one really go,
+	 * after passing through the link function.
+	 */
+	struct coro_bus_channel *link_dst;
+	coro_bus_link_f link_func;
+	void *link_ctx;
+	/** Channels linked to this one. */
+	struct rlist link_sources;
+	/** Link in the sources list of the destination. */
+	struct rlist in_link_sources;
+	/**
+	 * Sent messages held back until there are batch_max of them
+	 * or batch_delay passes since the first one. Not visible to
+	 * the receivers, but take space.
+	 */
+	struct data_vector batch;
+	size_t batch_max;
+	uint64_t batch_delay;
+	uint64_t batch_deadline;
+	/** Link in the list of channels with deferred receiver wakeups. */
+	struct rlist in_dirty;
+	/** Aggregation of the sent messages, if any. */
+	struct channel_window *window;
+	/**
+	 * Token bucket limiting the receive rate. Each received
+	 * message takes a token. Rate 0 means no limit.
+	 */
+	uint64_t rate;
+	uint64_t burst;
+	/** Tokens in the bucket, in CORO_BUS_TOKEN units per token. */
+	uint64_t tokens;
+	/** When the bucket was refilled last time. */
+	uint64_t refill_time;
+	/** Filter dropping the messages with recently seen keys. */
+	struct channel_dedup *dedup;
+	/** How many messages were dropped as duplicates. */
+	size_t deduplicated;
+	/**
+	 * In the ack mode the received messages stay in flight until
+	 * acknowledged, and are delivered again if the receiver gives
+	 * them back or doesn't ack them in time. They take space.
+	 */
+	bool is_acked;
+	/** How long a message can be in flight, 0 if infinite. */
+	uint64_t ack_timeout;
+	/** Tag of the next received message. */
+	uint64_t next_tag;
+	struct ack_vector acks;
+	/** Messages in flight, not done. */
+	size_t unacked;
+};
+
+/**
+ * A chain of channels sharing a budget of messages in flight. A
+ * message takes a credit when it is sent to the head channel and
+ * returns it when it leaves the tail channel.
+ */
+struct coro_bus_pipeline
+{
+	struct coro_bus_channel *head;
+	struct coro_bus_channel *tail;
+	size_t credits;
+	size_t in_flight;
+};
+
+/**
+ * Delayed messages are kept in a hierarchical timing wheel. Each
+ * level has 64 slots, a slot of the first level is one tick long,
+ * a slot of each next level covers a whole turn of the previous
+ * one. When a turn of a level is over, the next slot of the upper
+ * level is cascaded down.
+ */
+enum
+{
+	CORO_BUS_WHEEL_BITS = 6,
+	CORO_BUS_WHEEL_SLOTS = 1 << CORO_BUS_WHEEL_BITS,
+	CORO_BUS_WHEEL_LEVELS = 4,
+	/** Length of the tick in microseconds. */
+	CORO_BUS_WHEEL_TICK = 1000,
+};
+
+/** A message to be sent to a channel at the given time. */
+struct coro_bus_timer
+{
+	/** Link in a wheel slot or in the list of due timers. */
+	struct rlist in_wheel;
+	/** Link in the list of the channel's timers. */
+	struct rlist in_channel;
+	struct coro_bus_channel *chan;
+	uint64_t when;
+	unsigned data;
+	/** The timer is not in the wheel anymore, only waits for space. */
+	bool is_due;
+};
+
+struct coro_bus_wheel
+{
+	/** The latest tick the wheel has advanced to. */
+	uint64_t tick;
+	/** Number of timers in the slots. */
+	size_t count;
+	struct rlist slots[CORO_BUS_WHEEL_LEVELS][CORO_BUS_WHEEL_SLOTS];
+	/**
+	 * Timers whose time has come, in order of expiration. They
+	 * stay here while their channels are full.
+	 */
+	struct rlist due;
+};
+
+/**
+ * Correlation ID of a call consists of the reply slot index in
+ * the low bits and the slot generation in the high bits. So a
+ * late reply to a reused slot is recognized and dropped.
+ */
+enum
+{
+	CORO_BUS_RPC_INDEX_BITS = 16,
+	CORO_BUS_RPC_SLOTS_MAX = 1 << CORO_BUS_RPC_INDEX_BITS,
+};
+
+/** A one-shot place for the reply to a call. */
+struct rpc_slot
+{
+	/** Incremented on each release of the slot. */
+	unsigned generation;
+	bool is_busy;
+	bool has_reply;
+	unsigned reply;
+	/** The caller waiting for the reply. */
+	struct coro *waiter;
+	/** Channel where the request is queued, or -1 while sending. */
+	int channel;
+	/**
+	 * Flag of the caller, set when the request is lost together
+	 * with its channel or the bus. The slot is released for the
+	 * caller then, because the bus might be gone.
+	 */
+	bool *is_lost;
+};
+
+struct coro_future
+{
+	struct coro_bus *bus;
+	/** Coroutines waiting for the value. */
+	struct wakeup_queue waiters;
+	bool is_set;
+	unsigned value;
+	/** Next future in the pool of the bus. */
+	struct coro_future *next;
+};
+
+struct coro_bus
+{
+	struct coro_bus_channel **channels;
+	int channel_count;
+	struct wakeup_queue broadcast_queue;
+	struct coro_bus_wheel wheel;
+	/** Receivers are woken up only when the sender switches away. */
+	bool is_wakeup_deferred;
+	/** Deleted futures kept for reuse. Linked via their next. */
+	struct coro_future *future_pool;
+	/** Reply slots of the calls, reused via the free list. */
+	struct rpc_slot *rpc_slots;
+	unsigned rpc_slot_count;
+	unsigned *rpc_free;
+	unsigned rpc_free_count;
+	/**
+	 * Maximal number of messages in all the channels, queued,
+	 * held back in batches, or in flight. 0 means no limit.
+	 */
+	size_t budget;
+	/** Messages in all the channels now. */
+	size_t used;
+	/** Senders waiting for the budget to be freed. */
+	struct wakeup_queue budget_queue;
+};
+
+static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+
+uint64_t
+coro_bus_time_usec(void)
+{
+	/* The same clock as the scheduler's deadlines. */
+	return coro_time_usec();
+}
+
+/** How many more messages the bus budget allows. */
+static size_t
+coro_bus_budget_left(const struct coro_bus *bus)
+{
+	if (bus->budget == 0)
+		return SIZE_MAX;
+	return bus->used < bus->budget ? bus->budget - bus->used : 0;
+}
+
+/**
+ * Report that a message doesn't fit. It is a distinct error when
+ * the whole bus is out of its budget.
+ */
+static void
+coro_bus_errno_set_full(const struct coro_bus *bus)
+{
+	if (coro_bus_budget_left(bus) == 0)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_BUDGET);
+	else
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+}
+
+static void
+coro_bus_wheel_create(struct coro_bus_wheel *wheel)
+{
+	wheel->tick = coro_bus_time_usec() / CORO_BUS_WHEEL_TICK;
+	wheel->count = 0;
+	for (int l = 0; l < CORO_BUS_WHEEL_LEVELS; ++l)
+	{
+		for (int i = 0; i < CORO_BUS_WHEEL_SLOTS; ++i)
+			rlist_create(&wheel->slots[l][i]);
+	}
+	rlist_create(&wheel->due);
+}
+
+/**
+ * Put the timer into the slot matching its time, or into the due
+ * list right away if the time has come.
+ */
+static void
+coro_bus_wheel_insert(struct coro_bus_wheel *wheel, struct coro_bus_timer *t)
+{
+	/* Rounded up, a message is never delivered before its time. */
+	uint64_t tick = t->when / CORO_BUS_WHEEL_TICK +
+					(t->when % CORO_BUS_WHEEL_TICK != 0);
+	if (tick <= wheel->tick)
+	{
+		t->is_due = true;
+		rlist_add_tail_entry(&wheel->due, t, in_wheel);
+		return;
+	}
+	uint64_t delta = tick - wheel->tick;
+	int level = 0;
+	while (level < CORO_BUS_WHEEL_LEVELS - 1 &&
+		   delta >> (CORO_BUS_WHEEL_BITS * (level + 1)) != 0)
+		++level;
+	/*
+	 * Too far timers go to the last slot of the top level and are
+	 * cascaded back there until their time is close enough.
+	 */
+	uint64_t span = 1ull << (CORO_BUS_WHEEL_BITS * CORO_BUS_WHEEL_LEVELS);
+	if (delta >= span)
+		tick = wheel->tick + span - 1;
+	uint64_t slot = (tick >> (CORO_BUS_WHEEL_BITS * level)) &
+					(CORO_BUS_WHEEL_SLOTS - 1);
+	t->is_due = false;
+	rlist_add_tail_entry(&wheel->slots[level][slot], t, in_wheel);
+	++wheel->count;
+}
+
+/** Move the timers of an upper level slot to the lower levels. */
+static void
+coro_bus_wheel_cascade(struct coro_bus_wheel *wheel, int level)
+{
+	uint64_t slot = (wheel->tick >> (CORO_BUS_WHEEL_BITS * level)) &
+					(CORO_BUS_WHEEL_SLOTS - 1);
+	struct rlist list;
+	rlist_create(&list);
+	rlist_splice(&list, &wheel->slots[level][slot]);
+	while (!rlist_empty(&list))
+	{
+		struct coro_bus_timer *t = rlist_shift_entry(
+			&list, struct coro_bus_timer, in_wheel);
+		--wheel->count;
+		coro_bus_wheel_insert(wheel, t);
+	}
+}
+
+/** Advance the wheel to the current time, collecting the due timers. */
+static void
+coro_bus_wheel_advance(struct coro_bus_wheel *wheel)
+{
+	uint64_t target = coro_bus_time_usec() / CORO_BUS_WHEEL_TICK;
+	while (wheel->tick < target)
+	{
+		if (wheel->count == 0)
+		{
+			/* Nothing to cascade, can jump right away. */
+			wheel->tick = target;
+			break;
+		}
+		++wheel->tick;
+		for (int l = CORO_BUS_WHEEL_LEVELS - 1; l > 0; --l)
+		{
+			uint64_t mask = (1ull << (CORO_BUS_WHEEL_BITS * l)) - 1;
+			if ((wheel->tick & mask) == 0)
+				coro_bus_wheel_cascade(wheel, l);
+		}
+		struct rlist *slot =
+			&wheel->slots[0][wheel->tick & (CORO_BUS_WHEEL_SLOTS - 1)];
+		while (!rlist_empty(slot))
+		{
+			struct coro_bus_timer *t = rlist_shift_entry(
+				slot, struct coro_bus_timer, in_wheel);
+			--wheel->count;
+			t->is_due = true;
+			rlist_add_tail_entry(&wheel->due, t, in_wheel);
+		}
+	}
+}
+
+/** Remove the timer from the wheel and free it. */
+static void
+coro_bus_timer_delete(struct coro_bus_wheel *wheel, struct coro_bus_timer *t)
+{
+	if (!t->is_due)
+		--wheel->count;
+	rlist_del_entry(t, in_wheel);
+	rlist_del_entry(t, in_channel);
+	--t->chan->delayed;
+	free(t);
+}
+
+/**
+ * Channels having new messages for the receivers, but not woken
+ * them up yet. Global, because the coroutine switch hook is.
+ */
+static RLIST_HEAD(dirty_channels);
+
+/** Number of buses deferring the wakeups, they need the hook. */
+static size_t deferred_bus_count = 0;
+
+/**
+ * Wake up the receivers of all the dirty channels. Called when
+ * the current coroutine gives the control away.
+ */
+static void
+coro_bus_wakeup_dirty(void)
+{
+	while (!rlist_empty(&dirty_channels))
+	{
+		struct coro_bus_channel *chan = rlist_shift_entry(
+			&dirty_channels, struct coro_bus_channel, in_dirty);
+		wakeup_queue_wakeup_all(&chan->recv_queue);
+	}
+}
+
+/**
+ * Let the receivers know the channel has data. With deferred
+ * wakeups the channel is only marked, so a burst of sends costs
+ * one wakeup per receiver.
+ */
+static void
+coro_bus_channel_wakeup_recv(struct coro_bus_channel *chan)
+{
+	if (!chan->bus->is_wakeup_deferred)
+	{
+		wakeup_queue_wakeup_all(&chan->recv_queue);
+		return;
+	}
+	if (rlist_empty(&chan->in_dirty) && !rlist_empty(&chan->recv_queue.coros))
+		rlist_add_tail_entry(&dirty_channels, chan, in_dirty);
+}
+
+/** Find a channel by its descriptor. Sets NO_CHANNEL if not found. */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	return bus->channels[channel];
+}
+
+static void
+coro_bus_channel_sweep(struct coro_bus_channel *chan);
+
+/**
+ * How many messages can be sent by anyone but the reservation
+ * owner. A full channel might get some space by dropping the
+ * expired messages.
+ */
+static size_t
+coro_bus_channel_space(struct coro_bus_channel *chan)
+{
+	size_t space;
+	if (chan->link_dst != NULL)
+	{
+		/* A linked channel has the backpressure of its destination. */
+		space = coro_bus_channel_space(chan->link_dst);
+		space = space > chan->batch.size ? space - chan->batch.size : 0;
+	}
+	else if (chan->overflow != CORO_BUS_OVERFLOW_BLOCK)
+	{
+		/* Lossy channels take everything and drop what doesn't fit. */
+		return SIZE_MAX;
+	}
+	else
+	{
+		size_t used = chan->size + chan->reserved + chan->batch.size +
+					  chan->unacked;
+		if (used >= chan->size_limit && chan->has_deadlines)
+		{
+			coro_bus_channel_sweep(chan);
+			used = chan->size + chan->reserved + chan->batch.size +
+				   chan->unacked;
+		}
+		space = used < chan->size_limit ? chan->size_limit - used : 0;
+		size_t left = coro_bus_budget_left(chan->bus);
+		if (left < space)
+			space = left;
+	}
+	struct coro_bus_pipeline *p = chan->head_of;
+	if (p != NULL)
+	{
+		/* The held back batch will take credits too. */
+		size_t taken = p->in_flight + chan->batch.size;
+		size_t credits = taken < p->credits ? p->credits - taken : 0;
+		if (credits < space)
+			space = credits;
+	}
+	return space;
+}
+
+/**
+ * Whether the batch of the reservation owner fits. The owner sees
+ * the space with its own reservation given back.
+ */
+static bool
+coro_bus_channel_reserved_fits(struct coro_bus_channel *chan)
+{
+	size_t reserved = chan->reserved;
+	chan->reserved = 0;
+	size_t space = coro_bus_channel_space(chan);
+	chan->reserved = reserved;
+	return space >= reserved;
+}
+
+/**
+ * Note that @a count messages left the channel. If it is a
+ * pipeline tail, their credits are returned.
+ */
+static void
+coro_bus_channel_note_out(struct coro_bus_channel *chan, size_t count);
+
+/**
+ * Note that @a count messages were dropped from the channel
+ * without delivery. Their credits are returned both when it is a
+ * pipeline tail and when it is a head, because a dropped message
+ * never reaches the tail.
+ */
+static void
+coro_bus_channel_note_lost(struct coro_bus_channel *chan, size_t count);
+
+static void
+coro_bus_channel_flush(struct coro_bus_channel *chan);
+
+static void
+coro_bus_channel_window_feed(struct coro_bus_channel *chan, unsigned value);
+
+static void
+coro_bus_channel_apply_limit(struct coro_bus_channel *chan, size_t size_limit);
+
+/**
+ * Close the adaptation window. The limit grows when the senders
+ * were blocked often, and shrinks when they were not blocked at
+ * all while the space was mostly unused or the receivers were
+ * idling.
+ */
+static void
+coro_bus_channel_adapt(struct coro_bus_channel *chan)
+{
+	size_t limit = chan->size_limit;
+	if (chan->window_send_blocks * 8 > chan->window_ops)
+	{
+		limit = limit == 0 ? 1 : limit * 2;
+	}
+	else if (chan->window_send_blocks == 0 &&
+			 (chan->window_peak * 4 <= limit ||
+			  chan->window_recv_blocks * 2 > chan->window_ops))
+	{
+		limit /= 2;
+		if (limit < chan->window_peak)
+			limit = chan->window_peak;
+	}
+	if (limit < chan->adapt_min)
+		limit = chan->adapt_min;
+	if (limit > chan->adapt_max)
+		limit = chan->adapt_max;
+
+	chan->window_ops = 0;
+	chan->window_send_blocks = 0;
+	chan->window_recv_blocks = 0;
+	chan->window_peak = chan->size;
+	if (limit != chan->size_limit)
+		coro_bus_channel_apply_limit(chan, limit);
+}
+
+/** Account one send or receive operation. */
+static void
+coro_bus_channel_note_op(struct coro_bus_channel *chan)
+{
+	if (chan->size > chan->window_peak)
+		chan->window_peak = chan->size;
+	if (chan->adapt_max != 0 && ++chan->window_ops >= CORO_BUS_ADAPT_WINDOW)
+		coro_bus_channel_adapt(chan);
+}
+
+/** Queue of the messages with the given priority. */
+static struct data_vector *
+coro_bus_channel_level(struct coro_bus_channel *chan, unsigned prio)
+{
+	if (chan->levels == NULL)
+		return &chan->data;
+	if (prio >= chan->level_count)
+		prio = chan->level_count - 1;
+	return &chan->levels[prio];
+}
+
+/** Ring buffer of message sequence numbers. */
+struct seq_fifo
+{
+	uint64_t *data;
+	/** Position of the oldest number. */
+	size_t head;
+	size_t size;
+	/** A power of 2, or 0 if not allocated. */
+	size_t capacity;
+};
+
+static void
+seq_fifo_push(struct seq_fifo *fifo, uint64_t seq)
+{
+	if (fifo->size == fifo->capacity)
+	{
+		size_t capacity = fifo->capacity == 0 ? 4 : fifo->capacity * 2;
+		uint64_t *data = malloc(capacity * sizeof(data[0]));
+		for (size_t i = 0; i < fifo->size; ++i)
+			data[i] = fifo->data[(fifo->head + i) & (fifo->capacity - 1)];
+		free(fifo->data);
+		fifo->data = data;
+		fifo->head = 0;
+		fifo->capacity = capacity;
+	}
+	fifo->data[(fifo->head + fifo->size) & (fifo->capacity - 1)] = seq;
+	++fifo->size;
+}
+
+/** Take the oldest number out. The FIFO must not be empty. */
+static uint64_t
+seq_fifo_pop(struct seq_fifo *fifo)
+{
+	assert(fifo->size > 0);
+	uint64_t seq = fifo->data[fifo->head];
+	fifo->head = (fifo->head + 1) & (fifo->capacity - 1);
+	--fifo->size;
+	return seq;
+}
+
+/** Messages and receivers of one key in a matching channel. */
+struct match_key
+{
+	/**
+	 * Sequence numbers of the messages with the key, oldest first.
+	 * The messages expired in the middle of the channel leave their
+	 * numbers here. They are skipped when they come to the front.
+	 */
+	struct seq_fifo seqs;
+	/** Number of the messages with the key in the channel. */
+	size_t count;
+	/** Receivers waiting for a message with the key. */
+	struct wakeup_queue waiters;
+	/** Next unused record in the pool of the channel. */
+	struct match_key *next;
+};
+
+/** Find the record of the key, or make an empty one. */
+static struct match_key *
+coro_bus_channel_match_get(struct coro_bus_channel *chan, unsigned key)
+{
+	struct key_index_entry *e = key_index_find(&chan->index, key);
+	if (e != NULL)
+		return e->match;
+	struct match_key *m = chan->match_pool;
+	if (m != NULL)
+	{
+		chan->match_pool = m->next;
+	}
+	else
+	{
+		m = malloc(sizeof(*m));
+		memset(&m->seqs, 0, sizeof(m->seqs));
+	}
+	m->count = 0;
+	wakeup_queue_create(&m->waiters);
+	key_index_insert(&chan->index, key, 0)->match = m;
+	return m;
+}
+
+/** Drop the record of the key if it has no messages and receivers. */
+static void
+coro_bus_channel_match_put(struct coro_bus_channel *chan,
+						   struct key_index_entry *e)
+{
+	struct match_key *m = e->match;
+	if (m->count > 0 || m->waiters.count > 0)
+		return;
+	/* The stale numbers of the expired messages go too. */
+	m->seqs.head = 0;
+	m->seqs.size = 0;
+	m->next = chan->match_pool;
+	chan->match_pool = m;
+	key_index_delete(&chan->index, e);
+}
+
+/** Number of the messages with the key in a matching channel. */
+static size_t
+coro_bus_channel_match_count(struct coro_bus_channel *chan, unsigned key)
+{
+	struct key_index_entry *e = key_index_find(&chan->index, key);
+	return e != NULL ? e->match->count : 0;
+}
+
+/** Account the keys of the messages added to a matching channel. */
+static void
+coro_bus_channel_match_add(struct coro_bus_channel *chan,
+						   const unsigned *keys, size_t count)
+{
+	data_vector_append_many(&chan->keys, keys, count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct match_key *m = coro_bus_channel_match_get(chan, keys[i]);
+		uint64_t seq = chan->next_seq++;
+		time_vector_append(&chan->seqs, seq, 1);
+		seq_fifo_push(&m->seqs, seq);
+		++m->count;
+		/* Only the receivers of this key have a reason to wake up. */
+		wakeup_queue_wakeup_all(&m->waiters);
+	}
+}
+
+/**
+ * Account the @a count oldest messages gone from a matching
+ * channel, and drop their keys.
+ */
+static void
+coro_bus_channel_match_forget_first(struct coro_bus_channel *chan,
+									size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct key_index_entry *e = key_index_find(&chan->index,
+												   chan->keys.data[i]);
+		assert(e != NULL && e->match->count > 0);
+		/* The oldest of all is the oldest of its key, after the stale. */
+		while (seq_fifo_pop(&e->match->seqs) != chan->seqs.data[i])
+			;
+		--e->match->count;
+		coro_bus_channel_match_put(chan, e);
+	}
+	data_vector_drop_first(&chan->keys, count);
+	time_vector_drop_first(&chan->seqs, count);
+}
+
+/**
+ * Account all the messages gone from a matching channel at once.
+ * Only the keys with receivers waiting for them stay.
+ */
+static void
+coro_bus_channel_match_forget_all(struct coro_bus_channel *chan)
+{
+	size_t size = chan->index.bits == 0 ? 0 : (size_t)1 << chan->index.bits;
+	struct key_index_entry *waited = malloc(
+		(chan->index.count + 1) * sizeof(waited[0]));
+	size_t count = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		struct key_index_entry *e = &chan->index.entries[i];
+		if (!e->is_used)
+			continue;
+		struct match_key *m = e->match;
+		m->count = 0;
+		m->seqs.head = 0;
+		m->seqs.size = 0;
+		if (m->waiters.count > 0)
+		{
+			waited[count++] = *e;
+			continue;
+		}
+		m->next = chan->match_pool;
+		chan->match_pool = m;
+	}
+	key_index_clear(&chan->index);
+	for (size_t i = 0; i < count; ++i)
+		key_index_insert(&chan->index, waited[i].key, 0)->match = waited[i].match;
+	free(waited);
+	chan->seqs.size = 0;
+}
+
+/**
+ * Take the receivers of all the keys out of their queues and
+ * wake them up. The channel is going away.
+ */
+static void
+coro_bus_channel_match_wakeup_all(struct coro_bus_channel *chan)
+{
+	size_t size = chan->index.bits == 0 ? 0 : (size_t)1 << chan->index.bits;
+	for (size_t i = 0; i < size; ++i)
+	{
+		struct key_index_entry *e = &chan->index.entries[i];
+		if (!e->is_used)
+			continue;
+		while (!rlist_empty(&e->match->waiters.coros))
+		{
+			struct wakeup_entry *w = rlist_shift_entry(
+				&e->match->waiters.coros, struct wakeup_entry, base);
+			coro_wakeup(w->coro);
+		}
+		e->match->waiters.count = 0;
+	}
+	chan->match_waiters = 0;
+}
+
+/**
+ * Wake up the receivers of all the keys, leaving them in their
+ * queues. They check again what they wait for.
+ */
+static void
+coro_bus_channel_match_wakeup_keys(struct coro_bus_channel *chan)
+{
+	if (chan->match_waiters == 0)
+		return;
+	size_t size = chan->index.bits == 0 ? 0 : (size_t)1 << chan->index.bits;
+	for (size_t i = 0; i < size; ++i)
+	{
+		struct key_index_entry *e = &chan->index.entries[i];
+		if (e->is_used)
+			wakeup_queue_wakeup_all(&e->match->waiters);
+	}
+}
+
+/** Free the records of all the keys of a matching channel. */
+static void
+coro_bus_channel_match_destroy(struct coro_bus_channel *chan)
+{
+	size_t size = chan->index.bits == 0 ? 0 : (size_t)1 << chan->index.bits;
+	for (size_t i = 0; i < size; ++i)
+	{
+		struct key_index_entry *e = &chan->index.entries[i];
+		if (!e->is_used)
+			continue;
+		e->match->next = chan->match_pool;
+		chan->match_pool = e->match;
+	}
+	while (chan->match_pool != NULL)
+	{
+		struct match_key *m = chan->match_pool;
+		chan->match_pool = m->next;
+		free(m->seqs.data);
+		free(m);
+	}
+	free(chan->seqs.data);
+}
+
+/** Delete @a count oldest messages, the lowest priority ones first. */
+static void
+coro_bus_channel_drop_first(struct coro_bus_channel *chan, size_t count)
+{
+	assert(count <= chan->size);
+	if (chan->levels != NULL)
+	{
+		size_t left = count;
+		for (unsigned i = chan->level_count; i > 0 && left > 0; --i)
+		{
+			struct data_vector *level = &chan->levels[i - 1];
+			size_t n = left < level->size ? left : level->size;
+			data_vector_drop_first(level, n);
+			left -= n;
+		}
+	}
+	else
+	{
+		if (chan->is_conflating)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				struct key_index_entry *e = key_index_find(
+					&chan->index, chan->keys.data[i]);
+				assert(e != NULL && e->seq == chan->popped + i);
+				key_index_delete(&chan->index, e);
+			}
+			data_vector_drop_first(&chan->keys, count);
+		}
+		else if (chan->is_matching)
+		{
+			coro_bus_channel_match_forget_first(chan, count);
+		}
+		if (chan->has_deadlines)
+			time_vector_drop_first(&chan->deadlines, count);
+		data_vector_drop_first(&chan->data, count);
+	}
+	chan->size -= count;
+	chan->bus->used -= count;
+	coro_bus_channel_note_lost(chan, count);
+	chan->popped += count;
+}
+
+/** Check if a message with this key would not need new space. */
+static bool
+coro_bus_channel_replaces(struct coro_bus_channel *chan, unsigned key)
+{
+	if (chan->dedup != NULL &&
+		key_index_find(&chan->dedup->index, key) != NULL)
+		return true;
+	return chan->link_dst == NULL && chan->is_conflating && key_index_find(&chan->index, key) != NULL;
+}
+
+/**
+ * Check the key against the filter. A new key is remembered,
+ * pushing the oldest one out when the filter is full.
+ * @retval true The key is new.
+ * @retval false The key was seen recently.
+ */
+static bool
+channel_dedup_admit(struct channel_dedup *dedup, unsigned key)
+{
+	if (key_index_find(&dedup->index, key) != NULL)
+		return false;
+	if (dedup->count == dedup->size)
+	{
+		struct key_index_entry *e =
+			key_index_find(&dedup->index, dedup->ring[dedup->pos]);
+		assert(e != NULL);
+		key_index_delete(&dedup->index, e);
+		--dedup->count;
+	}
+	dedup->ring[dedup->pos] = key;
+	dedup->pos = (dedup->pos + 1) % dedup->size;
+	++dedup->count;
+	key_index_insert(&dedup->index, key, 0);
+	return true;
+}
+
+static void
+channel_dedup_delete(struct channel_dedup *dedup)
+{
+	if (dedup == NULL)
+		return;
+	free(dedup->ring);
+	key_index_destroy(&dedup->index);
+	free(dedup);
+}
+
+/**
+ * Put a message into a conflating channel. If a message with the
+ * same key is pending, it is replaced in place.
+ * @param limit Size limit of the channel, clamped by the budget.
+ */
+static void
+coro_bus_channel_push_conflating(struct coro_bus_channel *chan,
+								 unsigned key, unsigned data,
+								 uint64_t deadline, size_t limit)
+{
+	struct key_index_entry *e = key_index_find(&chan->index, key);
+	if (e != NULL)
+	{
+		size_t pos = e->seq - chan->popped;
+		chan->data.data[pos] = data;
+		if (chan->has_deadlines)
+			chan->deadlines.data[pos] = deadline;
+		++chan->conflated;
+		return;
+	}
+	if (chan->size >= limit &&
+		chan->overflow != CORO_BUS_OVERFLOW_BLOCK)
+	{
+		++chan->dropped;
+		++chan->window_send_blocks;
+		if (chan->overflow == CORO_BUS_OVERFLOW_DROP_NEWEST ||
+			chan->size == 0)
+		{
+			coro_bus_channel_note_lost(chan, 1);
+			return;
+		}
+		coro_bus_channel_drop_first(chan, 1);
+	}
+	key_index_insert(&chan->index, key, chan->popped + chan->size);
+	data_vector_append_many(&chan->keys, &key, 1);
+	data_vector_append_many(&chan->data, &data, 1);
+	if (chan->has_deadlines)
+		time_vector_append(&chan->deadlines, deadline, 1);
+	++chan->size;
+	++chan->bus->used;
+}
+
+/** Start keeping expiration times. The pending messages never expire. */
+static void
+coro_bus_channel_enable_deadlines(struct coro_bus_channel *chan)
+{
+	assert(chan->levels == NULL);
+	if (chan->has_deadlines)
+		return;
+	chan->has_deadlines = true;
+	time_vector_append(&chan->deadlines, UINT64_MAX, chan->size);
+}
+
+/**
+ * Append messages with the given priority and keys to the
+ * channel. The space must be checked already. Lossy channels drop
+ * what doesn't fit according to their overflow policy.
+ * @param ttl Time to live of the messages. 0 means the default
+ *     of the channel.
+ */
+static void
+coro_bus_channel_push_ex(struct coro_bus_channel *chan, unsigned prio,
+						 uint64_t ttl, const unsigned *keys,
+						 const unsigned *data, size_t count)
+{
+	/* The held back messages were sent earlier, they go first. */
+	if (chan->batch.size > 0 && data != chan->batch.data)
+		coro_bus_channel_flush(chan);
+	struct channel_dedup *dedup = chan->dedup;
+	if (dedup != NULL && !dedup->is_passing &&
+		(chan->window == NULL || !chan->window->is_emitting))
+	{
+		/* Push the runs of new messages between the duplicates. */
+		dedup->is_passing = true;
+		size_t begin = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (channel_dedup_admit(dedup, keys[i]))
+				continue;
+			++chan->deduplicated;
+			if (i > begin)
+				coro_bus_channel_push_ex(chan, prio, ttl, keys + begin,
+										 data + begin, i - begin);
+			begin = i + 1;
+		}
+		if (count > begin)
+			coro_bus_channel_push_ex(chan, prio, ttl, keys + begin,
+									 data + begin, count - begin);
+		dedup->is_passing = false;
+		return;
+	}
+	if (chan->window != NULL && !chan->window->is_emitting)
+	{
+		for (size_t i = 0; i < count; ++i)
+			coro_bus_channel_window_feed(chan, data[i]);
+		return;
+	}
+	if (chan->link_dst != NULL)
+	{
+		struct coro_bus_channel *dst = chan->link_dst;
+		size_t pushed = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			unsigned value = data[i];
+			if (!chan->link_func(chan->link_ctx, &value))
+				continue;
+			/*
+			 * Keyless messages carry their data as the key, so such a
+			 * key follows the transform. A keyed message with a key
+			 * equal to its data is treated the same way.
+			 */
+			unsigned key = keys[i] == data[i] ? value : keys[i];
+			/*
+			 * What goes through a pipeline head takes a credit before
+			 * the destination can drop it and give the credit back.
+			 */
+			if (chan->head_of != NULL)
+				++chan->head_of->in_flight;
+			coro_bus_channel_push_ex(dst, prio, ttl, &key, &value, 1);
+			++pushed;
+		}
+		if (pushed > 0)
+			coro_bus_channel_wakeup_recv(dst);
+		return;
+	}
+	struct data_vector *queue = coro_bus_channel_level(chan, prio);
+	size_t limit = chan->size_limit;
+	/* Lossy channels drop what doesn't fit into the budget too. */
+	size_t left = coro_bus_budget_left(chan->bus);
+	if (chan->size < limit && left < limit - chan->size)
+		limit = chan->size + left;
+	size_t old_size = chan->size;
+	uint64_t deadline = UINT64_MAX;
+	if (ttl == 0)
+		ttl = chan->ttl;
+	if (ttl != 0)
+	{
+		coro_bus_channel_enable_deadlines(chan);
+		deadline = coro_bus_time_usec() + ttl;
+	}
+	if (chan->is_conflating)
+	{
+		/* One by one, because any of them could be a replacement. */
+		for (size_t i = 0; i < count; ++i)
+			coro_bus_channel_push_conflating(chan, keys[i], data[i], deadline,
+											 limit);
+	}
+	else if (chan->overflow != CORO_BUS_OVERFLOW_BLOCK &&
+			 chan->size + count > limit)
+	{
+		size_t drop;
+		if (chan->overflow == CORO_BUS_OVERFLOW_DROP_NEWEST)
+		{
+			size_t fit = chan->size < limit ? limit - chan->size : 0;
+			drop = count - fit;
+			count = fit;
+			coro_bus_channel_note_lost(chan, drop);
+		}
+		else
+		{
+			/* Only the last messages of a huge batch survive. */
+			drop = 0;
+			if (count > limit)
+			{
+				drop = count - limit;
+				data += drop;
+				keys += drop;
+				count = limit;
+				coro_bus_channel_note_lost(chan, drop);
+			}
+			size_t old = chan->size + count - limit;
+			if (old > chan->size)
+				old = chan->size;
+			coro_bus_channel_drop_first(chan, old);
+			drop += old;
+		}
+		chan->dropped += drop;
+		/* Losing data means the limit is too small, like blocking. */
+		++chan->window_send_blocks;
+		data_vector_append_many(queue, data, count);
+		chan->size += count;
+		chan->bus->used += count;
+	}
+	else
+	{
+		data_vector_append_many(queue, data, count);
+		chan->size += count;
+		chan->bus->used += count;
+	}
+	if (chan->has_deadlines && !chan->is_conflating)
+		time_vector_append(&chan->deadlines, deadline, count);
+	if (chan->is_matching)
+		coro_bus_channel_match_add(chan, keys, count);
+	if (chan->size > chan->high_watermark)
+		chan->high_watermark = chan->size;
+	coro_bus_channel_note_op(chan);
+	if (chan->head_of != NULL && chan->size > old_size)
+		chan->head_of->in_flight += chan->size - old_size;
+}
+
+/**
+ * Append messages with the lowest priority to the channel. For
+ * conflating channels the messages are their own keys.
+ */
+static void
+coro_bus_channel_push_many(struct coro_bus_channel *chan,
+						   const unsigned *data, size_t count)
+{
+	coro_bus_channel_push_ex(chan, UINT_MAX, 0, data, data, count);
+}
+
+/** Push the held back messages to the channel as one batch. */
+static void
+coro_bus_channel_flush(struct coro_bus_channel *chan)
+{
+	size_t count = chan->batch.size;
+	if (count == 0)
+		return;
+	chan->batch.size = 0;
+	/* The messages are counted again when pushed. */
+	chan->bus->used -= count;
+	coro_bus_channel_push_ex(chan, UINT_MAX, 0, chan->batch.data,
+							 chan->batch.data, count);
+	coro_bus_channel_wakeup_recv(chan);
+}
+
+/** Flush the held back messages if they have waited long enough. */
+static void
+coro_bus_channel_flush_due(struct coro_bus_channel *chan)
+{
+	if (chan->batch.size > 0 && chan->batch_delay != 0 &&
+		coro_bus_time_usec() >= chan->batch_deadline)
+		coro_bus_channel_flush(chan);
+}
+
+/** Push a window summary to the channel, bypassing the window. */
+static void
+coro_bus_channel_window_emit(struct coro_bus_channel *chan, unsigned value)
+{
+	struct channel_window *w = chan->window;
+	w->is_emitting = true;
+	coro_bus_channel_push_ex(chan, UINT_MAX, 0, &value, &value, 1);
+	w->is_emitting = false;
+}
+
+/** Emit the summary of the current tumbling window, if not empty. */
+static void
+coro_bus_channel_window_close(struct coro_bus_channel *chan)
+{
+	struct channel_window *w = chan->window;
+	if (w->count == 0)
+		return;
+	w->count = 0;
+	coro_bus_channel_window_emit(chan, w->acc);
+}
+
+static unsigned
+window_reduce(enum coro_bus_window_op op, unsigned acc, unsigned value)
+{
+	switch (op)
+	{
+	case CORO_BUS_WINDOW_COUNT:
+		return acc + 1;
+	case CORO_BUS_WINDOW_SUM:
+		return acc + value;
+	case CORO_BUS_WINDOW_MIN:
+		return value < acc ? value : acc;
+	case CORO_BUS_WINDOW_MAX:
+		return value > acc ? value : acc;
+	}
+	assert(false);
+	return acc;
+}
+
+/** Add a message to a sliding window. */
+static void
+coro_bus_channel_window_slide(struct coro_bus_channel *chan, unsigned value)
+{
+	struct channel_window *w = chan->window;
+	uint64_t seq = w->seen++;
+	size_t pos = seq % w->size;
+	if (seq >= w->size)
+		w->sum -= w->ring[pos];
+	w->ring[pos] = value;
+	w->sum += value;
+	if (w->op == CORO_BUS_WINDOW_MIN || w->op == CORO_BUS_WINDOW_MAX)
+	{
+		/* Candidates out of the window go first, then the beaten ones. */
+		while (w->deque_len > 0 && w->deque[w->deque_head].seq + w->size <= seq)
+		{
+			w->deque_head = (w->deque_head + 1) % w->size;
+			--w->deque_len;
+		}
+		bool is_min = w->op == CORO_BUS_WINDOW_MIN;
+		while (w->deque_len > 0)
+		{
+			unsigned back = w->deque[(w->deque_head + w->deque_len - 1) %
+									 w->size].value;
+			if (is_min ? back < value : back > value)
+				break;
+			--w->deque_len;
+		}
+		struct window_candidate *c =
+			&w->deque[(w->deque_head + w->deque_len) % w->size];
+		c->seq = seq;
+		c->value = value;
+		++w->deque_len;
+	}
+	if (w->seen < w->size || (w->seen - w->size) % w->slide != 0)
+		return;
+	unsigned summary;
+	switch (w->op)
+	{
+	case CORO_BUS_WINDOW_COUNT:
+		summary = w->size;
+		break;
+	case CORO_BUS_WINDOW_SUM:
+		summary = w->sum;
+		break;
+	default:
+		summary = w->deque[w->deque_head].value;
+		break;
+	}
+	coro_bus_channel_window_emit(chan, summary);
+}
+
+static void
+coro_bus_channel_window_feed(struct coro_bus_channel *chan, unsigned value)
+{
+	struct channel_window *w = chan->window;
+	if (w->slide != 0)
+	{
+		coro_bus_channel_window_slide(chan, value);
+		return;
+	}
+	if (w->period != 0)
+	{
+		uint64_t now = coro_bus_time_usec();
+		if (w->count > 0 && now >= w->deadline)
+			coro_bus_channel_window_close(chan);
+		if (w->count == 0)
+		{
+			w->deadline = now + w->period;
+			/* The receivers sleep until the new window ends. */
+			coro_bus_channel_wakeup_recv(chan);
+		}
+	}
+	if (w->count == 0)
+		w->acc = w->op == CORO_BUS_WINDOW_COUNT ? 1 : value;
+	else
+		w->acc = window_reduce(w->op, w->acc, value);
+	++w->count;
+	if (w->size != 0 && w->count >= w->size)
+		coro_bus_channel_window_close(chan);
+}
+
+/** Emit the summary of a window by time if it is over. */
+static void
+coro_bus_channel_window_due(struct coro_bus_channel *chan)
+{
+	struct channel_window *w = chan->window;
+	if (w != NULL && w->period != 0 && w->count > 0 &&
+		coro_bus_time_usec() >= w->deadline)
+		coro_bus_channel_window_close(chan);
+}
+
+/** Delete the window of the channel. */
+static void
+coro_bus_channel_window_delete(struct coro_bus_channel *chan)
+{
+	struct channel_window *w = chan->window;
+	if (w == NULL)
+		return;
+	chan->window = NULL;
+	free(w->ring);
+	free(w->deque);
+	free(w);
+}
+
+/**
+ * Choose the queue to take the next message from. Strict order
+ * takes the highest non-empty level. Weighted order lets each
+ * level take up to its weight of messages per round, and a round
+ * ends when none of the non-empty levels has credits left.
+ */
+static struct data_vector *
+coro_bus_channel_pick_level(struct coro_bus_channel *chan)
+{
+	assert(chan->size > 0);
+	if (chan->levels == NULL)
+		return &chan->data;
+	unsigned count = chan->level_count;
+	if (!chan->is_weighted)
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (chan->levels[i].size > 0)
+				return &chan->levels[i];
+		}
+	}
+	for (int round = 0; round < 2; ++round)
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (chan->levels[i].size > 0 && chan->level_credits[i] > 0)
+			{
+				--chan->level_credits[i];
+				return &chan->levels[i];
+			}
+		}
+		memcpy(chan->level_credits, chan->level_weights,
+			   sizeof(chan->level_credits[0]) * count);
+	}
+	assert(false);
+	return NULL;
+}
+
+/** Pop the next message and its key. The channel must not be empty. */
+static unsigned
+coro_bus_channel_pop_keyed(struct coro_bus_channel *chan, unsigned *key)
+{
+	struct data_vector *queue = coro_bus_channel_pick_level(chan);
+	unsigned data = data_vector_pop_first(queue);
+	*key = data;
+	if (chan->rate != 0)
+		chan->tokens -= CORO_BUS_TOKEN;
+	if (chan->is_conflating)
+	{
+		*key = chan->keys.data[0];
+		struct key_index_entry *e = key_index_find(&chan->index, *key);
+		assert(e != NULL && e->seq == chan->popped);
+		key_index_delete(&chan->index, e);
+		data_vector_drop_first(&chan->keys, 1);
+	}
+	else if (chan->is_matching)
+	{
+		*key = chan->keys.data[0];
+		coro_bus_channel_match_forget_first(chan, 1);
+	}
+	if (chan->has_deadlines)
+		time_vector_drop_first(&chan->deadlines, 1);
+	--chan->size;
+	--chan->bus->used;
+	++chan->popped;
+	coro_bus_channel_note_op(chan);
+	coro_bus_channel_note_out(chan, 1);
+	return data;
+}
+
+/** Pop the next message. The channel must not be empty. */
+static unsigned
+coro_bus_channel_pop(struct coro_bus_channel *chan)
+{
+	unsigned key;
+	return coro_bus_channel_pop_keyed(chan, &key);
+}
+
+/** Free the channel with all its messages. */
+static void
+coro_bus_channel_destroy(struct coro_bus_channel *chan)
+{
+	chan->bus->used -= chan->size + chan->batch.size + chan->unacked;
+	while (!rlist_empty(&chan->timers))
+	{
+		struct coro_bus_timer *t = rlist_first_entry(
+			&chan->timers, struct coro_bus_timer, in_channel);
+		coro_bus_timer_delete(&chan->bus->wheel, t);
+	}
+	rlist_del_entry(chan, in_dirty);
+	if (chan->link_dst != NULL)
+		rlist_del_entry(chan, in_link_sources);
+	while (!rlist_empty(&chan->link_sources))
+	{
+		struct coro_bus_channel *src = rlist_shift_entry(
+			&chan->link_sources, struct coro_bus_channel, in_link_sources);
+		src->link_dst = NULL;
+	}
+	if (chan->head_of != NULL)
+		chan->head_of->head = NULL;
+	if (chan->tail_of != NULL)
+		chan->tail_of->tail = NULL;
+	for (unsigned i = 0; chan->levels != NULL && i < chan->level_count; ++i)
+		free(chan->levels[i].data);
+	free(chan->levels);
+	free(chan->data.data);
+	free(chan->keys.data);
+	free(chan->deadlines.data);
+	free(chan->batch.data);
+	coro_bus_channel_window_delete(chan);
+	channel_dedup_delete(chan->dedup);
+	free(chan->acks.data);
+	if (chan->is_matching)
+		coro_bus_channel_match_destroy(chan);
+	key_index_destroy(&chan->index);
+	free(chan);
+}
+
+/**
+ * Suspend the current coroutine until the channel has space or
+ * the deadline comes. UINT64_MAX means no deadline.
+ */
+static void
+coro_bus_channel_wait_send_until(struct coro_bus_channel *chan,
+								 struct wakeup_queue *queue,
+								 uint64_t deadline)
+{
+	++chan->send_blocks;
+	++chan->window_send_blocks;
+	/* Space in this channel won't help if the budget is out. */
+	size_t need = chan->reserve_owner == coro_this() ? chan->reserved : 1;
+	if (coro_bus_budget_left(chan->bus) < need)
+		queue = &chan->bus->budget_queue;
+	wakeup_queue_suspend_this_until(queue, deadline);
+}
+
+/** Suspend the current coroutine until the channel has space. */
+static void
+coro_bus_channel_wait_send(struct coro_bus_channel *chan,
+						   struct wakeup_queue *queue)
+{
+	coro_bus_channel_wait_send_until(chan, queue, UINT64_MAX);
+}
+
+/** When the next token is refilled, or UINT64_MAX if not needed. */
+static uint64_t
+coro_bus_channel_next_token(struct coro_bus_channel *chan)
+{
+	if (chan->rate == 0 || chan->size == 0 ||
+		chan->tokens >= CORO_BUS_TOKEN)
+		return UINT64_MAX;
+	return chan->refill_time + (CORO_BUS_TOKEN - chan->tokens +
+		chan->rate - 1) / chan->rate;
+}
+
+/**
+ * When the wheel gets to the nearest delayed message of the
+ * channel, or UINT64_MAX if there are none.
+ */
+static uint64_t
+coro_bus_channel_next_timer(struct coro_bus_channel *chan)
+{
+	uint64_t when = UINT64_MAX;
+	struct coro_bus_timer *t;
+	rlist_foreach_entry(t, &chan->timers, in_channel)
+	{
+		uint64_t tick;
+		if (t->is_due)
+		{
+			/*
+			 * Due, but the channel or the bus budget has no space.
+			 * Not every release of the budget runs the timers, so
+			 * check again on the next tick.
+			 */
+			tick = chan->bus->wheel.tick + 1;
+		}
+		else
+		{
+			tick = t->when / CORO_BUS_WHEEL_TICK +
+				   (t->when % CORO_BUS_WHEEL_TICK != 0);
+		}
+		if (tick * CORO_BUS_WHEEL_TICK < when)
+			when = tick * CORO_BUS_WHEEL_TICK;
+	}
+	return when;
+}
+
+/**
+ * When the channel can get data for the receivers without any
+ * sender, or UINT64_MAX if never. Nobody wakes the receivers up
+ * then, they have to wake up by themselves.
+ */
+static uint64_t
+coro_bus_channel_next_event(struct coro_bus_channel *chan)
+{
+	uint64_t when = coro_bus_channel_next_token(chan);
+	uint64_t timer = coro_bus_channel_next_timer(chan);
+	if (timer < when)
+		when = timer;
+	if (chan->batch.size > 0 && chan->batch_delay != 0 &&
+		chan->batch_deadline < when)
+		when = chan->batch_deadline;
+	struct channel_window *w = chan->window;
+	if (w != NULL && w->period != 0 && w->count > 0 && w->deadline < when)
+		when = w->deadline;
+	if (chan->unacked > 0 && chan->ack_timeout != 0)
+	{
+		/* Deadlines grow with the tags, the first one is the nearest. */
+		for (size_t i = 0; i < chan->acks.size; ++i)
+		{
+			struct ack_entry *e = &chan->acks.data[i];
+			if (e->is_done)
+				continue;
+			if (e->deadline < when)
+				when = e->deadline;
+			break;
+		}
+	}
+	return when;
+}
+
+/** Suspend the current coroutine until the channel has data. */
+static void
+coro_bus_channel_wait_recv(struct coro_bus_channel *chan)
+{
+	++chan->recv_blocks;
+	++chan->window_recv_blocks;
+	wakeup_queue_suspend_this_until(&chan->recv_queue,
+									coro_bus_channel_next_event(chan));
+}
+
+/**
+ * Wakeup the senders which might be able to proceed after some
+ * messages were consumed. The reservation owner is woken up only
+ * when its whole batch fits.
+ */
+static void
+coro_bus_channel_wakeup_senders(struct coro_bus_channel *chan)
+{
+	if (chan->reserve_owner != NULL)
+	{
+		if (coro_bus_channel_reserved_fits(chan))
+			coro_wakeup(chan->reserve_owner);
+	}
+	else
+	{
+		wakeup_queue_wakeup_first(&chan->atomic_queue);
+	}
+	if (coro_bus_channel_space(chan) > 0)
+		wakeup_queue_wakeup_first(&chan->send_queue);
+	/* Senders of the linked channels wait for this one's space. */
+	struct coro_bus_channel *src;
+	rlist_foreach_entry(src, &chan->link_sources, in_link_sources)
+		coro_bus_channel_wakeup_senders(src);
+	/* Any consumed message could free the budget. */
+	wakeup_queue_wakeup_first(&chan->bus->budget_queue);
+}
+
+/** Give back the credits of @a count messages which left the pipeline. */
+static void
+coro_bus_pipeline_put(struct coro_bus_pipeline *p, size_t count)
+{
+	if (p == NULL || count == 0)
+		return;
+	/* The messages sent before the pipeline was made had no credits. */
+	if (count > p->in_flight)
+		count = p->in_flight;
+	p->in_flight -= count;
+	if (p->head != NULL && count > 0)
+		coro_bus_channel_wakeup_senders(p->head);
+}
+
+static void
+coro_bus_channel_note_out(struct coro_bus_channel *chan, size_t count)
+{
+	coro_bus_pipeline_put(chan->tail_of, count);
+}
+
+static void
+coro_bus_channel_note_lost(struct coro_bus_channel *chan, size_t count)
+{
+	coro_bus_channel_note_out(chan, count);
+	/* A head which is the tail too has just returned them. */
+	if (chan->head_of != chan->tail_of)
+		coro_bus_pipeline_put(chan->head_of, count);
+}
+
+/**
+ * Deliver the delayed messages whose time has come. The ones
+ * targeting full channels wait in the due list until there is
+ * space.
+ */
+static void
+coro_bus_run_timers(struct coro_bus *bus)
+{
+	struct coro_bus_wheel *wheel = &bus->wheel;
+	coro_bus_wheel_advance(wheel);
+	struct coro_bus_timer *t, *tmp;
+	rlist_foreach_entry_safe(t, &wheel->due, in_wheel, tmp)
+	{
+		struct coro_bus_channel *chan = t->chan;
+		if (coro_bus_channel_space(chan) == 0 &&
+			!coro_bus_channel_replaces(chan, t->data))
+			continue;
+		coro_bus_channel_push_ex(chan, UINT_MAX, 0, &t->data, &t->data, 1);
+		coro_bus_channel_wakeup_recv(chan);
+		coro_bus_timer_delete(wheel, t);
+	}
+}
+
+/**
+ * Drop all the expired messages, wherever they are. Takes linear
+ * time, so it is done only when the channel is full and not more
+ * often than once per sweep period.
+ */
+static void
+coro_bus_channel_sweep(struct coro_bus_channel *chan)
+{
+	uint64_t now = coro_bus_time_usec();
+	if (now < chan->next_sweep)
+		return;
+	chan->next_sweep = now + CORO_BUS_SWEEP_PERIOD;
+
+	size_t kept = 0;
+	for (size_t i = 0; i < chan->size; ++i)
+	{
+		bool is_expired = chan->deadlines.data[i] <= now;
+		if (chan->is_conflating)
+		{
+			struct key_index_entry *e = key_index_find(&chan->index,
+													   chan->keys.data[i]);
+			assert(e != NULL);
+			if (is_expired)
+				key_index_delete(&chan->index, e);
+			else
+				e->seq = chan->popped + kept;
+		}
+		else if (chan->is_matching && is_expired)
+		{
+			/* Its number stays in the FIFO of the key till the front. */
+			struct key_index_entry *e = key_index_find(&chan->index,
+													   chan->keys.data[i]);
+			assert(e != NULL && e->match->count > 0);
+			--e->match->count;
+			coro_bus_channel_match_put(chan, e);
+		}
+		if (is_expired)
+			continue;
+		if (chan->is_conflating || chan->is_matching)
+			chan->keys.data[kept] = chan->keys.data[i];
+		if (chan->is_matching)
+			chan->seqs.data[kept] = chan->seqs.data[i];
+		chan->data.data[kept] = chan->data.data[i];
+		chan->deadlines.data[kept] = chan->deadlines.data[i];
+		++kept;
+	}
+	chan->expired += chan->size - kept;
+	coro_bus_channel_note_lost(chan, chan->size - kept);
+	chan->bus->used -= chan->size - kept;
+	chan->size = kept;
+	chan->data.size = kept;
+	chan->deadlines.size = kept;
+	if (chan->is_conflating || chan->is_matching)
+		chan->keys.size = kept;
+	if (chan->is_matching)
+		chan->seqs.size = kept;
+}
+
+/**
+ * Drop the expired messages from the head of the queue, so the
+ * receivers never get them.
+ */
+static void
+coro_bus_channel_expire_at(struct coro_bus_channel *chan, uint64_t now)
+{
+	if (!chan->has_deadlines || chan->size == 0)
+		return;
+	size_t count = 0;
+	while (count < chan->size && chan->deadlines.data[count] <= now)
+		++count;
+	if (count == 0)
+		return;
+	coro_bus_channel_drop_first(chan, count);
+	chan->expired += count;
+	coro_bus_channel_wakeup_senders(chan);
+	wakeup_queue_wakeup_first(&chan->bus->broadcast_queue);
+}
+
+static void
+coro_bus_channel_expire(struct coro_bus_channel *chan)
+{
+	if (chan->has_deadlines)
+		coro_bus_channel_expire_at(chan, coro_bus_time_usec());
+}
+
+/**
+ * Pop the next message which is not expired by @a now. Only the
+ * head is checked on the receive, so the messages behind it with
+ * shorter lives are dropped here. Returns false if none is left.
+ */
+static bool
+coro_bus_channel_pop_live(struct coro_bus_channel *chan, uint64_t now,
+						  unsigned *data)
+{
+	coro_bus_channel_expire_at(chan, now);
+	if (chan->size == 0)
+		return false;
+	*data = coro_bus_channel_pop(chan);
+	return true;
+}
+
+/** Put the messages back to the head of the queue, in order. */
+static void
+coro_bus_channel_redeliver(struct coro_bus_channel *chan,
+						   const unsigned *data, size_t count)
+{
+	if (count == 0)
+		return;
+	data_vector_prepend_many(&chan->data, data, count);
+	if (chan->has_deadlines)
+		time_vector_prepend(&chan->deadlines, UINT64_MAX, count);
+	chan->size += count;
+	chan->unacked -= count;
+	coro_bus_channel_wakeup_recv(chan);
+}
+
+/**
+ * Forget the done messages at the head of the flight window, so
+ * it doesn't grow while the acks come in order.
+ */
+static void
+coro_bus_channel_acks_compact(struct coro_bus_channel *chan)
+{
+	struct ack_vector *acks = &chan->acks;
+	size_t count = 0;
+	while (count < acks->size && acks->data[count].is_done)
+		++count;
+	if (count == 0)
+		return;
+	acks->size -= count;
+	memmove(acks->data, &acks->data[count], acks->size * sizeof(acks->data[0]));
+}
+
+/**
+ * Give back the messages in flight which are not done. They are
+ * delivered again in the order of their first delivery.
+ * @param owner Give back only the messages of this receiver. NULL
+ *     means any receiver.
+ * @param now Give back only the messages with deadline not after
+ *     this time.
+ */
+static void
+coro_bus_channel_acks_return(struct coro_bus_channel *chan,
+							 struct coro *owner, uint64_t now)
+{
+	struct ack_vector *acks = &chan->acks;
+	struct data_vector back = {NULL, 0, 0};
+	for (size_t i = 0; i < acks->size; ++i)
+	{
+		struct ack_entry *e = &acks->data[i];
+		/* Deadlines grow with the tags. */
+		if (e->deadline > now)
+			break;
+		if (e->is_done || (owner != NULL && e->owner != owner))
+			continue;
+		e->is_done = true;
+		data_vector_append_many(&back, &e->data, 1);
+	}
+	coro_bus_channel_redeliver(chan, back.data, back.size);
+	free(back.data);
+	coro_bus_channel_acks_compact(chan);
+}
+
+/** Make everything due visible to the receivers of the channel. */
+static void
+coro_bus_channel_prepare_recv(struct coro_bus *bus,
+							  struct coro_bus_channel *chan)
+{
+	coro_bus_run_timers(bus);
+	coro_bus_channel_flush_due(chan);
+	coro_bus_channel_window_due(chan);
+	coro_bus_channel_expire(chan);
+	if (chan->unacked > 0 && chan->ack_timeout != 0)
+		coro_bus_channel_acks_return(chan, NULL, coro_bus_time_usec());
+}
+
+/** Add the tokens earned since the last refill. */
+static void
+coro_bus_channel_refill(struct coro_bus_channel *chan)
+{
+	uint64_t now = coro_bus_time_usec();
+	uint64_t full = chan->burst * CORO_BUS_TOKEN;
+	uint64_t passed = now - chan->refill_time;
+	chan->refill_time = now;
+	if (passed >= (full - chan->tokens) / chan->rate + 1)
+		chan->tokens = full;
+	else
+		chan->tokens += passed * chan->rate;
+}
+
+/** How many messages the receivers can take right now. */
+static size_t
+coro_bus_channel_ready(struct coro_bus_channel *chan)
+{
+	if (chan->rate == 0)
+		return chan->size;
+	coro_bus_channel_refill(chan);
+	uint64_t tokens = chan->tokens / CORO_BUS_TOKEN;
+	return tokens < chan->size ? tokens : chan->size;
+}
+
+enum coro_bus_error_code
+coro_bus_errno(void)
+{
+	return global_error;
+}
+
+void coro_bus_errno_set(enum coro_bus_error_code err)
+{
+	global_error = err;
+}
+
+struct coro_bus *
+coro_bus_new(void)
+{
+	struct coro_bus *bus = malloc(sizeof(*bus));
+	if (!bus)
+		return NULL;
+
+	bus->channels = NULL;
+	bus->channel_count = 0;
+	wakeup_queue_create(&bus->broadcast_queue);
+	wakeup_queue_create(&bus->budget_queue);
+	coro_bus_wheel_create(&bus->wheel);
+	bus->is_wakeup_deferred = false;
+	bus->future_pool = NULL;
+	bus->rpc_slots = NULL;
+	bus->rpc_slot_count = 0;
+	bus->rpc_free = NULL;
+	bus->rpc_free_count = 0;
+	bus->budget = 0;
+	bus->used = 0;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return bus;
+}
+
+#if NEED_BATCH
+
+static void
+coro_bus_rpc_fail(struct coro_bus *bus, int channel);
+
+#endif
+
+void coro_bus_delete(struct coro_bus *bus)
+{
+	if (bus == NULL)
+		return;
+
+	/*
+	 * Release the switch hook if no other bus needs it. The
+	 * destroyed channels leave the dirty list by themselves.
+	 */
+	coro_bus_set_deferred_wakeups(bus, false);
+
+	/* 1) wake up all broadcast waiting coros */
+	while (!rlist_empty(&bus->broadcast_queue.coros))
+	{
+		struct wakeup_entry *e = rlist_shift_entry(
+			&bus->broadcast_queue.coros,
+			struct wakeup_entry, base);
+		coro_wakeup(e->coro);
+	}
+
+	/* 2) wake up all send/recv for all channels */
+	for (int i = 0; i < bus->channel_count; ++i)
+	{
+		struct coro_bus_channel *chan = bus->channels[i];
+		if (!chan)
+			continue;
+
+		while (!rlist_empty(&chan->send_queue.coros))
+		{
+			struct wakeup_entry *e = rlist_shift_entry(
+				&chan->send_queue.coros,
+				struct wakeup_entry, base);
+			coro_wakeup(e->coro);
+		}
+		while (!rlist_empty(&chan->recv_queue.coros))
+		{
+			struct wakeup_entry *e = rlist_shift_entry(
+				&chan->recv_queue.coros,
+				struct wakeup_entry, base);
+			coro_wakeup(e->coro);
+		}
+		while (!rlist_empty(&chan->atomic_queue.coros))
+		{
+			struct wakeup_entry *e = rlist_shift_entry(
+				&chan->atomic_queue.coros,
+				struct wakeup_entry, base);
+			coro_wakeup(e->coro);
+		}
+		if (chan->is_matching)
+			coro_bus_channel_match_wakeup_all(chan);
+
+		coro_bus_channel_destroy(chan);
+	}
+	assert(bus->used == 0);
+#if NEED_BATCH
+	/* 3) fail the calls waiting for replies */
+	coro_bus_rpc_fail(bus, -1);
+#endif
+
+	free(bus->channels);
+	while (bus->future_pool != NULL)
+	{
+		struct coro_future *f = bus->future_pool;
+		bus->future_pool = f->next;
+		free(f);
+	}
+	free(bus->rpc_slots);
+	free(bus->rpc_free);
+	free(bus);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = size_limit;
+	opts.overflow = CORO_BUS_OVERFLOW_BLOCK;
+	return coro_bus_channel_open_opts(bus, &opts);
+}
+
+int coro_bus_channel_open_opts(struct coro_bus *bus,
+							   const struct coro_bus_channel_opts *opts)
+{
+	if (bus == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	if (opts->prio_levels > CORO_BUS_PRIO_MAX ||
+		(opts->prio_levels > 1 && opts->is_conflating) ||
+		(opts->is_matching &&
+		 (opts->is_conflating || opts->prio_levels > 1)) ||
+		(opts->is_acked && (opts->is_conflating || opts->is_matching ||
+							opts->prio_levels > 1)) ||
+		(opts->prio_levels > 1 && opts->ttl_usec != 0))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+
+	struct coro_bus_channel *chan = malloc(sizeof(*chan));
+	if (chan == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return -1;
+	}
+
+	memset(chan, 0, sizeof(*chan));
+	if (opts->prio_levels > 1)
+	{
+		unsigned count = opts->prio_levels;
+		chan->level_count = count;
+		chan->levels = calloc(count, sizeof(chan->levels[0]));
+		chan->is_weighted = opts->is_prio_weighted;
+		for (unsigned i = 0; i < count; ++i)
+		{
+			unsigned w = opts->prio_weights[i];
+			/* By default each level is worth twice the next one. */
+			chan->level_weights[i] = w != 0 ? w : 1u << (count - 1 - i);
+		}
+	}
+	chan->bus = bus;
+	chan->size_limit = opts->size_limit;
+	chan->overflow = opts->overflow;
+	chan->is_conflating = opts->is_conflating;
+	chan->is_matching = opts->is_matching;
+	chan->is_acked = opts->is_acked;
+	chan->ack_timeout = opts->ack_timeout_usec;
+	chan->next_tag = 1;
+	chan->ttl = opts->ttl_usec;
+	rlist_create(&chan->timers);
+	rlist_create(&chan->link_sources);
+	rlist_create(&chan->in_link_sources);
+	rlist_create(&chan->in_dirty);
+	wakeup_queue_create(&chan->recv_queue);
+	wakeup_queue_create(&chan->send_queue);
+	wakeup_queue_create(&chan->atomic_queue);
+
+	int id = 0;
+	for (id = 0; id < bus->channel_count; ++id)
+	{
+		if (bus->channels[id] == NULL)
+		{
+			bus->channels[id] = chan;
+			break;
+		}
+	}
+
+	if (id == bus->channel_count)
+	{
+		int new_count = bus->channel_count + 1;
+		bus->channels = realloc(bus->channels, new_count * sizeof(*bus->channels));
+		bus->channels[bus->channel_count] = chan;
+		id = bus->channel_count;
+		bus->channel_count = new_count;
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return id;
+}
+
+void coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return;
+	}
+
+	struct coro_bus_channel *chan = bus->channels[channel];
+	bus->channels[channel] = NULL;
+
+	/* 1) Wake up all coroutines waiting for send with error NO_CHANNEL */
+	while (!rlist_empty(&chan->send_queue.coros))
+	{
 		struct wakeup_entry *e = rlist_shift_entry(
 			&chan->send_queue.coros,
 			struct wakeup_entry, base);
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		coro_wakeup(e->coro);
+		coro_wakeup(e->coro);
+	}
+	/* 2) Wake up all coroutines waiting for recv with error NO_CHANNEL */
+	while (!rlist_empty(&chan->recv_queue.coros))
+	{
+		struct wakeup_entry *e = rlist_shift_entry(
+			&chan->recv_queue.coros,
+			struct wakeup_entry, base);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		coro_wakeup(e->coro);
+	}
+	/* 3) Same for the atomic batch senders */
+	while (!rlist_empty(&chan->atomic_queue.coros))
+	{
+		struct wakeup_entry *e = rlist_shift_entry(
+			&chan->atomic_queue.coros,
+			struct wakeup_entry, base);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		coro_wakeup(e->coro);
+	}
+	/* 4) And for the receivers waiting for a key */
+	if (chan->is_matching)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		coro_bus_channel_match_wakeup_all(chan);
+	}
+
+#if NEED_BATCH
+	/* 5) And for the callers whose requests are in the channel */
+	coro_bus_rpc_fail(bus, channel);
+#endif
+
+	coro_bus_channel_destroy(chan);
+	/* The messages of the channel are not in the budget anymore. */
+	wakeup_queue_wakeup_all(&bus->budget_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+}
+
+int coro_bus_channel_stat(struct coro_bus *bus, int channel,
+						  struct coro_bus_channel_stat *stat)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	stat->size = chan->size;
+	stat->size_limit = chan->size_limit;
+	stat->send_waiters = chan->send_queue.count + chan->atomic_queue.count;
+	stat->recv_waiters = chan->recv_queue.count + chan->match_waiters;
+	stat->high_watermark = chan->high_watermark;
+	stat->send_blocks = chan->send_blocks;
+	stat->recv_blocks = chan->recv_blocks;
+	stat->dropped = chan->dropped;
+	stat->conflated = chan->conflated;
+	stat->expired = chan->expired;
+	stat->delayed = chan->delayed;
+	stat->batched = chan->batch.size;
+	stat->deduplicated = chan->deduplicated;
+	stat->in_flight = chan->unacked;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+/**
+ * Set the new size limit and wakeup the senders which fit into
+ * the new space.
+ */
+static void
+coro_bus_channel_apply_limit(struct coro_bus_channel *chan, size_t size_limit)
+{
+	/*
+	 * Pending messages are kept even if there are more of them
+	 * than the new limit. Then the senders just wait longer.
+	 */
+	chan->size_limit = size_limit;
+	if (chan->reserve_owner != NULL)
+	{
+		if (coro_bus_channel_reserved_fits(chan))
+			coro_wakeup(chan->reserve_owner);
+	}
+	else
+	{
+		wakeup_queue_wakeup_first(&chan->atomic_queue);
+	}
+	/* Each woken sender takes at least one of the new slots. */
+	wakeup_queue_wakeup_n(&chan->send_queue, coro_bus_channel_space(chan));
+	wakeup_queue_wakeup_first(&chan->bus->broadcast_queue);
+	/* Don't hold much more memory than the channel can use. */
+	if (chan->data.capacity > 2 * size_limit)
+		data_vector_shrink(&chan->data, size_limit);
+	if (chan->keys.capacity > 2 * size_limit)
+		data_vector_shrink(&chan->keys, size_limit);
+}
+
+int coro_bus_channel_set_limit(struct coro_bus *bus, int channel,
+							   size_t size_limit)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	coro_bus_channel_apply_limit(chan, size_limit);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_channel_set_adaptive(struct coro_bus *bus, int channel,
+								  size_t min_limit, size_t max_limit)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	/* 0 as the max turns the mode off, the min doesn't matter then. */
+	if (max_limit != 0 && min_limit > max_limit)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	chan->adapt_min = min_limit;
+	chan->adapt_max = max_limit;
+	chan->window_ops = 0;
+	chan->window_send_blocks = 0;
+	chan->window_recv_blocks = 0;
+	chan->window_peak = chan->size;
+	if (max_limit != 0)
+	{
+		if (chan->size_limit < min_limit)
+			coro_bus_channel_apply_limit(chan, min_limit);
+		else if (chan->size_limit > max_limit)
+			coro_bus_channel_apply_limit(chan, max_limit);
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_send_keyed(bus, channel, data, data);
+}
+
+int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_try_send_keyed(bus, channel, data, data);
+}
+
+int coro_bus_send_keyed(struct coro_bus *bus, int channel, unsigned key,
+						unsigned data)
+{
+	/*
+	 * Try sending in a loop, until success. If error, then
+	 * check which one is that. If 'wouldblock', then suspend
+	 * this coroutine and try again when woken up.
+	 *
+	 * If see the channel has space, then wakeup the first
+	 * coro in the send-queue. That is needed so when there is
+	 * enough space for many messages, and many coroutines are
+	 * waiting, they would then wake each other up one by one
+	 * as lone as there is still space.
+	 */
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	while (true)
+	{
+		if (coro_bus_try_send_keyed(bus, channel, key, data) == 0)
+		{
+			return 0;
+		}
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		{
+			return -1;
+		}
+		/* if  WOULD_BLOCK — block current corotine */
+		coro_bus_channel_wait_send(chan, &chan->send_queue);
+	}
+}
+
+int coro_bus_try_send_keyed(struct coro_bus *bus, int channel, unsigned key,
+							unsigned data)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	if (chan->batch_max > 1 && coro_bus_channel_space(chan) > 0)
+	{
+		/* Batching channels never keep the keys, the key is data. */
+		if (chan->batch.size == 0)
+		{
+			chan->batch_deadline = coro_bus_time_usec() + chan->batch_delay;
+			/* The receivers sleep until the new batch is due. */
+			if (chan->batch_delay != 0)
+				coro_bus_channel_wakeup_recv(chan);
+		}
+		data_vector_append_many(&chan->batch, &data, 1);
+		++bus->used;
+		if (chan->batch.size >= chan->batch_max)
+			coro_bus_channel_flush(chan);
+		else
+			coro_bus_channel_flush_due(chan);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+	if (coro_bus_channel_space(chan) > 0 ||
+		coro_bus_channel_replaces(chan, key))
+	{
+		coro_bus_channel_push_ex(chan, UINT_MAX, 0, &key, &data, 1);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		coro_bus_channel_wakeup_recv(chan);
+		return 0;
+	}
+	/*
+	 * Append data if has space. Otherwise 'wouldblock' error.
+	 * Wakeup the first coro in the recv-queue! To let it know
+	 * there is data.
+	 */
+	coro_bus_errno_set_full(bus);
+	return -1;
+}
+
+int coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+					   unsigned data)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	while (true)
+	{
+		if (coro_bus_try_send_prio(bus, channel, prio, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		coro_bus_channel_wait_send(chan, &chan->send_queue);
+	}
+}
+
+int coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+						   unsigned data)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	if (coro_bus_channel_space(chan) > 0 ||
+		coro_bus_channel_replaces(chan, data))
+	{
+		coro_bus_channel_push_ex(chan, prio, 0, &data, &data, 1);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		coro_bus_channel_wakeup_recv(chan);
+		return 0;
+	}
+	coro_bus_errno_set_full(bus);
+	return -1;
+}
+
+int coro_bus_send_ttl(struct coro_bus *bus, int channel, unsigned data,
+					  uint64_t ttl_usec)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	while (true)
+	{
+		if (coro_bus_try_send_ttl(bus, channel, data, ttl_usec) == 0)
+			return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK &&
+			coro_bus_errno() != CORO_BUS_ERR_NO_BUDGET)
+			return -1;
+		coro_bus_channel_wait_send(chan, &chan->send_queue);
+	}
+}
+
+int coro_bus_try_send_ttl(struct coro_bus *bus, int channel, unsigned data,
+						  uint64_t ttl_usec)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (chan->levels != NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+
+	if (coro_bus_channel_space(chan) > 0 ||
+		coro_bus_channel_replaces(chan, data))
+	{
+		coro_bus_channel_push_ex(chan, UINT_MAX, ttl_usec, &data, &data, 1);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		coro_bus_channel_wakeup_recv(chan);
+		return 0;
+	}
+	coro_bus_errno_set_full(bus);
+	return -1;
+}
+
+int coro_bus_send_at(struct coro_bus *bus, int channel, unsigned data,
+					 uint64_t when_usec)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	struct coro_bus_timer *t = malloc(sizeof(*t));
+	t->chan = chan;
+	t->when = when_usec;
+	t->data = data;
+	rlist_add_tail_entry(&chan->timers, t, in_channel);
+	++chan->delayed;
+	/* Don't put the timer relative to a stale tick after idling. */
+	coro_bus_wheel_advance(&bus->wheel);
+	if (when_usec <= coro_bus_time_usec())
+	{
+		t->is_due = true;
+		rlist_add_tail_entry(&bus->wheel.due, t, in_wheel);
+	}
+	else
+	{
+		coro_bus_wheel_insert(&bus->wheel, t);
+		/* The receivers might sleep until a later time. */
+		coro_bus_channel_wakeup_recv(chan);
+		if (chan->is_matching)
+			coro_bus_channel_match_wakeup_keys(chan);
+	}
+	coro_bus_run_timers(bus);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	while (true)
+	{
+		if (coro_bus_try_recv(bus, channel, data) == 0)
+		{
+			return 0;
+		}
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		{
+			return -1;
+		}
+		/* if  WOULD_BLOCK — block current corotine */
+		coro_bus_channel_wait_recv(chan);
+	}
+}
+
+int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	coro_bus_channel_prepare_recv(bus, chan);
+	if (coro_bus_channel_ready(chan) > 0)
+	{
+		unsigned int value = coro_bus_channel_pop(chan);
+		*data = value;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		coro_bus_channel_wakeup_senders(chan);
+		wakeup_queue_wakeup_first(&bus->broadcast_queue);
+		return 0;
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	return -1;
+}
+
+int coro_bus_recv_keyed(struct coro_bus *bus, int channel, unsigned *key,
+						unsigned *data)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+
+	while (true)
+	{
+		if (coro_bus_try_recv_keyed(bus, channel, key, data) == 0)
+			return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		coro_bus_channel_wait_recv(chan);
+	}
+}
+
+int coro_bus_try_recv_keyed(struct coro_bus *bus, int channel, unsigned *key,
+							unsigned *data)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (!chan->is_conflating && !chan->is_matching)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	coro_bus_channel_prepare_recv(bus, chan);
+	if (coro_bus_channel_ready(chan) == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	*data = coro_bus_channel_pop_keyed(chan, key);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	coro_bus_channel_wakeup_senders(chan);
+	wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	return 0;
+}
+
+#if NEED_BROADCAST
+
+int coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+{
+	if (!bus || bus->channel_count == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	while (true)
+	{
+		if (coro_bus_try_broadcast(bus, data) == 0)
+			return 0;
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+			return -1;
+		wakeup_queue_suspend_this(&bus->broadcast_queue);
+	}
+}
+
+int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	if (!bus || bus->channel_count == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	size_t count = 0;
+
+	for (int id = 0; id < bus->channel_count; ++id)
+	{
+		struct coro_bus_channel *chan = bus->channels[id];
+		if (!chan)
+			continue;
+		++count;
+		if (coro_bus_channel_space(chan) == 0)
+		{
+			coro_bus_errno_set_full(bus);
+			return -1;
+		}
+	}
+
+	if (count == 0)
+	{
+		/* If all channels were null */
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/* Each channel's space has the whole budget, but all take one. */
+	if (coro_bus_budget_left(bus) < count)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_BUDGET);
+		return -1;
+	}
+
+	for (int id = 0; id < bus->channel_count; ++id)
+	{
+		if (!bus->channels[id])
+			continue;
+		coro_bus_channel_push_many(bus->channels[id], &data, 1);
+		coro_bus_channel_wakeup_recv(bus->channels[id]);
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+#endif
+
+#if NEED_BATCH
+
+int coro_bus_try_send_v(struct coro_bus *bus, int channel,
+						const unsigned *data, unsigned count)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	size_t avail = coro_bus_channel_space(chan);
+	if (avail == 0)
+	{
+		coro_bus_errno_set_full(bus);
+		return -1;
+	}
+
+	unsigned to_send = count < avail ? count : (unsigned)avail;
+
+	coro_bus_channel_push_many(chan, data, to_send);
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	coro_bus_channel_wakeup_recv(chan);
+
+	return to_send; 
+}
+
+int coro_bus_send_v(struct coro_bus *bus, int channel,
+					const unsigned *data, unsigned count)
+{
+	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[channel];
+
+	/* 2) Пытаемся до тех пор, пока хоть что-то не отправим или не увидим NO_CHANNEL */
+	/* Try sending in a loop, until success. If error, then
+	 * check which one is that. If 'wouldblock', then suspend
+	 * this coroutine and try again when woken up.
+	 *
+	 * If see the channel has space, then wakeup the first
+	 * coro in the send-queue. That is needed so when there is
+	 * enough space for many messages, and many coroutines are
+	 * waiting, they would then wake each other up one by one
+	 * as long as there is still space.
+	 */
+	while (true)
+	{
+		int sent = coro_bus_try_send_v(bus, channel, data, count);
+		if (sent > 0)
+		{
+			return sent;
+		}
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		{
+			return -1;
+		}
+		/* If WOULD_BLOCK, suspend current coroutine */
+		coro_bus_channel_wait_send(chan, &chan->send_queue);
+	}
+}
+
+int coro_bus_try_send_v_atomic(struct coro_bus *bus, int channel,
+							   const unsigned *data, unsigned count)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (chan->link_dst != NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+
+	if (count > chan->size_limit || coro_bus_channel_space(chan) < count)
+	{
+		coro_bus_errno_set_full(bus);
+		return -1;
+	}
+	if (chan->overflow == CORO_BUS_OVERFLOW_DROP_NEWEST &&
+		chan->size + count > chan->size_limit)
+	{
+		/* Drop the whole batch, not its tail. */
+		chan->dropped += count;
+		++chan->window_send_blocks;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return count;
+	}
+	coro_bus_channel_push_many(chan, data, count);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	coro_bus_channel_wakeup_recv(chan);
+	return count;
+}
+
+int coro_bus_send_v_atomic(struct coro_bus *bus, int channel,
+						   const unsigned *data, unsigned count)
+{
+	/*
+	 * The first atomic sender which doesn't fit takes a
+	 * reservation. While it is held, the other senders can't
+	 * eat the space freed by the receivers beyond what is left
+	 * after the reserved batch. The next atomic senders wait in
+	 * the queue until the reservation is released.
+	 */
+	struct coro *self = coro_this();
+	while (true)
+	{
+		struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+		if (chan == NULL)
+			return -1;
+		if (chan->link_dst != NULL)
+		{
+			coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+			return -1;
+		}
+
+		bool is_owner = chan->reserve_owner == self;
+		if (count > chan->size_limit ||
+			(bus->budget != 0 && count > bus->budget))
+		{
+			/* Would never fit. */
+			if (is_owner)
+			{
+				chan->reserve_owner = NULL;
+				chan->reserved = 0;
+				coro_bus_channel_wakeup_senders(chan);
+			}
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (is_owner)
+		{
+			if (coro_bus_channel_reserved_fits(chan) &&
+				coro_bus_budget_left(bus) >= count)
+			{
+				chan->reserve_owner = NULL;
+				chan->reserved = 0;
+				coro_bus_channel_push_many(chan, data, count);
+				coro_bus_errno_set(CORO_BUS_ERR_NONE);
+				coro_bus_channel_wakeup_recv(chan);
+				/* Let the next atomic sender take the reservation. */
+				coro_bus_channel_wakeup_senders(chan);
+				return count;
+			}
+		}
+		else if (coro_bus_try_send_v_atomic(bus, channel, data, count) >= 0)
+		{
+			return count;
+		}
+		else if (chan->reserve_owner == NULL)
+		{
+			chan->reserve_owner = self;
+			chan->reserved = count;
+		}
+		coro_bus_channel_wait_send(chan, &chan->atomic_queue);
+	}
+}
+
+int coro_bus_try_recv_v(struct coro_bus *bus, int ch,
+						unsigned *out, unsigned capacity)
+{
+	if (!bus || ch < 0 || ch >= bus->channel_count || bus->channels[ch] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[ch];
+
+	coro_bus_channel_prepare_recv(bus, chan);
+	size_t ready = coro_bus_channel_ready(chan);
+	uint64_t now = coro_bus_time_usec();
+	unsigned got = 0;
+	while (got < capacity)
+	{
+		if (got < ready && coro_bus_channel_pop_live(chan, now, &out[got]))
+		{
+			++got;
+			/* If we have space, wakeup the first waiting sender */
+			coro_bus_channel_wakeup_senders(chan);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if (got > 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return got;
+	}
+	else
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+}
+
+int coro_bus_recv_v(struct coro_bus *bus, int ch,
+					unsigned *out, unsigned capacity)
+{
+	if (!bus || ch < 0 || ch >= bus->channel_count || bus->channels[ch] == NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chan = bus->channels[ch];
+
+	unsigned total = 0;
+	while (total < capacity)
+	{
+		int rc = coro_bus_try_recv_v(bus, ch, out + total, capacity - total);
+		if (rc > 0)
+		{
+			total += rc;
+			/* If buffer is still not empty, try again */
+			continue;
+		}
+		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		{
+			return -1;
+		}
+		/* WOULD_BLOCK and at the same time we have not taken any yet —
+		block, and after waking up we will try again */
+		if (total == 0)
+		{
+			coro_bus_channel_wait_recv(chan);
+			continue;
+		}
+		break;
+	}
+
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return total;
+}
+
+int coro_bus_drain_swap(struct coro_bus *bus, int channel,
+						struct coro_bus_buffer *buffer)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	/* The messages in the buffer would be lost in the channel. */
+	if (buffer->size != 0 || chan->levels != NULL || chan->rate != 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	/* Taken first, so the head left by the expiration is alive. */
+	uint64_t now = coro_bus_time_usec();
+	coro_bus_channel_prepare_recv(bus, chan);
+	if (chan->size == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	struct data_vector full = chan->data;
+	size_t kept = full.size;
+	if (chan->has_deadlines)
+	{
+		/* Only the head was checked, the rest might be expired. */
+		kept = 0;
+		for (size_t i = 0; i < full.size; ++i)
+		{
+			if (chan->deadlines.data[i] > now)
+				full.data[kept++] = full.data[i];
+		}
+	}
+	chan->data.data = buffer->data;
+	chan->data.size = 0;
+	chan->data.capacity = buffer->capacity;
+	buffer->data = full.data;
+	buffer->size = kept;
+	buffer->capacity = full.capacity;
+	chan->popped += full.size;
+	chan->size = 0;
+	bus->used -= full.size;
+	chan->expired += full.size - kept;
+	coro_bus_channel_note_out(chan, kept);
+	coro_bus_channel_note_lost(chan, full.size - kept);
+	chan->keys.size = 0;
+	chan->deadlines.size = 0;
+	if (chan->is_matching)
+		coro_bus_channel_match_forget_all(chan);
+	else
+		key_index_clear(&chan->index);
+
+	/* The channel is empty now, everyone has a chance to fit. */
+	if (chan->reserve_owner != NULL)
+		coro_wakeup(chan->reserve_owner);
+	else
+		wakeup_queue_wakeup_first(&chan->atomic_queue);
+	wakeup_queue_wakeup_all(&chan->send_queue);
+	wakeup_queue_wakeup_all(&bus->budget_queue);
+	wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return kept;
+}
+
+#endif
+/**
+ * Number of points each member has on the hash ring. The more
+ * points, the more even the keys are spread.
+ */
+enum
+{
+	CORO_BUS_PARTITION_REPLICAS = 64,
+};
+
+/** A point on the hash ring owned by a member channel. */
+struct partition_point
+{
+	uint32_t hash;
+	int channel;
+};
+
+struct coro_bus_partition
+{
+	struct coro_bus *bus;
+	/** Points of all the members, sorted by hash. */
+	struct partition_point *ring;
+	size_t ring_size;
+	size_t member_count;
+};
+
+/** Well mixed 32 bits of a 64 bit value. */
+static uint32_t
+partition_hash(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return (uint32_t)x;
+}
+
+static int
+partition_point_cmp(const void *a, const void *b)
+{
+	const struct partition_point *pa = a;
+	const struct partition_point *pb = b;
+	if (pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return pa->channel - pb->channel;
+}
+
+/** Check if the channel is a member of the partition. */
+static bool
+coro_bus_partition_has(const struct coro_bus_partition *p, int channel)
+{
+	for (size_t i = 0; i < p->ring_size; ++i)
+	{
+		if (p->ring[i].channel == channel)
+			return true;
+	}
+	return false;
+}
+
+struct coro_bus_partition *
+coro_bus_partition_new(struct coro_bus *bus)
+{
+	struct coro_bus_partition *p = malloc(sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->bus = bus;
+	p->ring = NULL;
+	p->ring_size = 0;
+	p->member_count = 0;
+	return p;
+}
+
+void coro_bus_partition_delete(struct coro_bus_partition *p)
+{
+	if (p == NULL)
+		return;
+	free(p->ring);
+	free(p);
+}
+
+int coro_bus_partition_add(struct coro_bus_partition *p, int channel)
+{
+	if (coro_bus_channel_get(p->bus, channel) == NULL)
+		return -1;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	if (coro_bus_partition_has(p, channel))
+		return 0;
+
+	size_t size = p->ring_size + CORO_BUS_PARTITION_REPLICAS;
+	p->ring = realloc(p->ring, size * sizeof(p->ring[0]));
+	for (unsigned i = 0; i < CORO_BUS_PARTITION_REPLICAS; ++i)
+	{
+		struct partition_point *point = &p->ring[p->ring_size + i];
+		point->hash = partition_hash((uint64_t)channel << 32 | i);
+		point->channel = channel;
+	}
+	p->ring_size = size;
+	++p->member_count;
+	qsort(p->ring, p->ring_size, sizeof(p->ring[0]), partition_point_cmp);
+	return 0;
+}
+
+int coro_bus_partition_remove(struct coro_bus_partition *p, int channel)
+{
+	if (!coro_bus_partition_has(p, channel))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/* Filtering keeps the ring sorted. */
+	size_t kept = 0;
+	for (size_t i = 0; i < p->ring_size; ++i)
+	{
+		if (p->ring[i].channel != channel)
+			p->ring[kept++] = p->ring[i];
+	}
+	p->ring_size = kept;
+	--p->member_count;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_partition_route(const struct coro_bus_partition *p, unsigned key)
+{
+	if (p->ring_size == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/* The first point clockwise from the key owns it. */
+	uint32_t hash = partition_hash(key);
+	size_t left = 0;
+	size_t right = p->ring_size;
+	while (left < right)
+	{
+		size_t mid = left + (right - left) / 2;
+		if (p->ring[mid].hash < hash)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	if (left == p->ring_size)
+		left = 0;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return p->ring[left].channel;
+}
+
+int coro_bus_partition_send_keyed(struct coro_bus_partition *p, unsigned key,
+								  unsigned data)
+{
+	int channel = coro_bus_partition_route(p, key);
+	if (channel < 0)
+		return -1;
+	return coro_bus_send_keyed(p->bus, channel, key, data);
+}
+
+int coro_bus_partition_try_send_keyed(struct coro_bus_partition *p,
+									  unsigned key, unsigned data)
+{
+	int channel = coro_bus_partition_route(p, key);
+	if (channel < 0)
+		return -1;
+	return coro_bus_try_send_keyed(p->bus, channel, key, data);
+}
+
+struct coro_bus_dispatcher
+{
+	struct coro_bus *bus;
+	/** Descriptors of the member channels. */
+	int *members;
+	size_t member_count;
+	/** Where to start the next search, so ties go round robin. */
+	size_t next;
+};
+
+/**
+ * Pick the least loaded member with space. If there is none,
+ * return -1 with WOULD_BLOCK, or NO_CHANNEL if no member is open.
+ */
+static int
+coro_bus_dispatcher_pick(struct coro_bus_dispatcher *d)
+{
+	int best = -1;
+	size_t best_pos = 0;
+	size_t best_size = SIZE_MAX;
+	bool has_full = false;
+	for (size_t i = 0; i < d->member_count; ++i)
+	{
+		size_t pos = (d->next + i) % d->member_count;
+		int channel = d->members[pos];
+		if (channel >= d->bus->channel_count ||
+			d->bus->channels[channel] == NULL)
+			continue;
+		struct coro_bus_channel *chan = d->bus->channels[channel];
+		if (coro_bus_channel_space(chan) == 0)
+			has_full = true;
+		else if (chan->size < best_size)
+		{
+			best_size = chan->size;
+			best = channel;
+			best_pos = pos;
+		}
+	}
+	if (best >= 0)
+	{
+		d->next = (best_pos + 1) % d->member_count;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return best;
+	}
+	if (has_full)
+		coro_bus_errno_set_full(d->bus);
+	else
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return -1;
+}
+
+struct coro_bus_dispatcher *
+coro_bus_dispatcher_new(struct coro_bus *bus)
+{
+	struct coro_bus_dispatcher *d = malloc(sizeof(*d));
+	if (d == NULL)
+		return NULL;
+	d->bus = bus;
+	d->members = NULL;
+	d->member_count = 0;
+	d->next = 0;
+	return d;
+}
+
+void coro_bus_dispatcher_delete(struct coro_bus_dispatcher *d)
+{
+	if (d == NULL)
+		return;
+	free(d->members);
+	free(d);
+}
+
+int coro_bus_dispatcher_add(struct coro_bus_dispatcher *d, int channel)
+{
+	if (coro_bus_channel_get(d->bus, channel) == NULL)
+		return -1;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	for (size_t i = 0; i < d->member_count; ++i)
+	{
+		if (d->members[i] == channel)
+			return 0;
+	}
+	d->members = realloc(d->members,
+						 (d->member_count + 1) * sizeof(d->members[0]));
+	d->members[d->member_count++] = channel;
+	return 0;
+}
+
+int coro_bus_dispatcher_remove(struct coro_bus_dispatcher *d, int channel)
+{
+	for (size_t i = 0; i < d->member_count; ++i)
+	{
+		if (d->members[i] != channel)
+			continue;
+		memmove(&d->members[i], &d->members[i + 1],
+				(d->member_count - i - 1) * sizeof(d->members[0]));
+		--d->member_count;
+		d->next = 0;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return -1;
+}
+
+int coro_bus_dispatcher_send(struct coro_bus_dispatcher *d, unsigned data)
+{
+	while (true)
+	{
+		int channel = coro_bus_dispatcher_pick(d);
+		if (channel >= 0)
+			return coro_bus_try_send(d->bus, channel, data);
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK &&
+			coro_bus_errno() != CORO_BUS_ERR_NO_BUDGET)
+			return -1;
+		/*
+		 * All the open members are full. Wait until any of them
+		 * gets space, then the choice is made again.
+		 */
+		struct wakeup_queue **queues =
+			malloc((d->member_count + 1) * sizeof(queues[0]));
+		size_t count = 0;
+		for (size_t i = 0; i < d->member_count; ++i)
+		{
+			struct coro_bus_channel *chan =
+				coro_bus_channel_get(d->bus, d->members[i]);
+			if (chan == NULL)
+				continue;
+			++chan->send_blocks;
+			++chan->window_send_blocks;
+			queues[count++] = &chan->send_queue;
+		}
+		if (coro_bus_budget_left(d->bus) == 0)
+			queues[count++] = &d->bus->budget_queue;
+		wakeup_queue_suspend_this_any(queues, count, UINT64_MAX);
+		free(queues);
+		/*
+		 * More than one member could have woken this coroutine up.
+		 * Pass the wakeups on, so they are not lost for the usual
+		 * senders of these channels.
+		 */
+		for (size_t i = 0; i < d->member_count; ++i)
+		{
+			struct coro_bus_channel *chan =
+				coro_bus_channel_get(d->bus, d->members[i]);
+			if (chan != NULL && coro_bus_channel_space(chan) > 0)
+				wakeup_queue_wakeup_first(&chan->send_queue);
+		}
+	}
+}
+
+int coro_bus_dispatcher_try_send(struct coro_bus_dispatcher *d, unsigned data)
+{
+	int channel = coro_bus_dispatcher_pick(d);
+	if (channel < 0)
+		return -1;
+	return coro_bus_try_send(d->bus, channel, data);
+}
+
+struct coro_future *
+coro_bus_future_new(struct coro_bus *bus)
+{
+	struct coro_future *f = bus->future_pool;
+	if (f != NULL)
+	{
+		bus->future_pool = f->next;
 	}
-	/* 2) Wake up all coroutines waiting for recv with error NO_CHANNEL */
-	while (!rlist_empty(&chan->recv_queue.coros))
+	else
 	{
-		struct wakeup_entry *e = rlist_shift_entry(
-			&chan->recv_queue.coros,
-			struct wakeup_entry, base);
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		coro_wakeup(e->coro);
+		f = malloc(sizeof(*f));
+		if (f == NULL)
+			return NULL;
+		f->bus = bus;
 	}
+	wakeup_queue_create(&f->waiters);
+	f->is_set = false;
+	f->value = 0;
+	f->next = NULL;
+	return f;
+}
 
-	free(chan->data.data);
-	free(chan);
-	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+void coro_future_delete(struct coro_future *f)
+{
+	if (f == NULL)
+		return;
+	assert(rlist_empty(&f->waiters.coros));
+	f->next = f->bus->future_pool;
+	f->bus->future_pool = f;
 }
 
-int coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+int coro_future_set(struct coro_future *f, unsigned value)
+{
+	if (f->is_set)
+		return -1;
+	f->value = value;
+	f->is_set = true;
+	wakeup_queue_wakeup_all(&f->waiters);
+	return 0;
+}
+
+bool coro_future_is_set(const struct coro_future *f)
+{
+	return f->is_set;
+}
+
+unsigned coro_future_await(struct coro_future *f)
+{
+	while (!f->is_set)
+		wakeup_queue_suspend_this(&f->waiters);
+	return f->value;
+}
+
+int coro_future_await_any(struct coro_future **futures, size_t count)
+{
+	if (count == 0)
+		return -1;
+	struct wakeup_queue **queues = malloc(count * sizeof(queues[0]));
+	for (size_t i = 0; i < count; ++i)
+		queues[i] = &futures[i]->waiters;
+	while (true)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (futures[i]->is_set)
+			{
+				free(queues);
+				return i;
+			}
+		}
+		wakeup_queue_suspend_this_any(queues, count, UINT64_MAX);
+	}
+}
+
+void coro_future_await_all(struct coro_future **futures, size_t count)
+{
+	/* Each future is set only once, so one pass is enough. */
+	for (size_t i = 0; i < count; ++i)
+		coro_future_await(futures[i]);
+}
+
+#if NEED_BATCH
+
+/**
+ * Check if the channel keeps the ID and the request of each call
+ * together. The others could drop, hold back, reorder or split
+ * the pairs. An expired request would leave its call waiting
+ * forever.
+ */
+static bool
+coro_bus_channel_is_service(const struct coro_bus_channel *chan)
+{
+	return chan->overflow == CORO_BUS_OVERFLOW_BLOCK &&
+		   !chan->is_conflating && !chan->is_matching && !chan->is_acked &&
+		   chan->rate == 0 && chan->dedup == NULL && chan->batch_max <= 1 &&
+		   chan->window == NULL && chan->link_dst == NULL &&
+		   chan->ttl == 0 && !chan->has_deadlines;
+}
+
+/** Take a free reply slot. Returns its index or -1 if too many calls. */
+static int
+coro_bus_rpc_slot_take(struct coro_bus *bus, bool *is_lost)
+{
+	unsigned index;
+	if (bus->rpc_free_count > 0)
+	{
+		index = bus->rpc_free[--bus->rpc_free_count];
+	}
+	else
+	{
+		if (bus->rpc_slot_count == CORO_BUS_RPC_SLOTS_MAX)
+			return -1;
+		index = bus->rpc_slot_count++;
+		bus->rpc_slots = realloc(bus->rpc_slots,
+								 bus->rpc_slot_count * sizeof(bus->rpc_slots[0]));
+		/* The free list can't be longer than the slot count. */
+		bus->rpc_free = realloc(bus->rpc_free,
+								bus->rpc_slot_count * sizeof(bus->rpc_free[0]));
+		bus->rpc_slots[index].generation = 0;
+	}
+	struct rpc_slot *slot = &bus->rpc_slots[index];
+	slot->is_busy = true;
+	slot->has_reply = false;
+	slot->waiter = coro_this();
+	slot->channel = -1;
+	slot->is_lost = is_lost;
+	return index;
+}
+
+/** Release the slot. Replies to its current ID are ignored from now. */
+static void
+coro_bus_rpc_slot_release(struct coro_bus *bus, unsigned index)
+{
+	struct rpc_slot *slot = &bus->rpc_slots[index];
+	slot->is_busy = false;
+	++slot->generation;
+	bus->rpc_free[bus->rpc_free_count++] = index;
+}
+
+/**
+ * Fail the calls whose requests were queued into the channel, or
+ * into any channel if it is -1. Their callers are woken up.
+ */
+static void
+coro_bus_rpc_fail(struct coro_bus *bus, int channel)
+{
+	for (unsigned i = 0; i < bus->rpc_slot_count; ++i)
+	{
+		struct rpc_slot *slot = &bus->rpc_slots[i];
+		if (!slot->is_busy || slot->has_reply || slot->channel < 0 ||
+			(channel >= 0 && slot->channel != channel))
+			continue;
+		*slot->is_lost = true;
+		coro_wakeup(slot->waiter);
+		coro_bus_rpc_slot_release(bus, i);
+	}
+}
+
+int coro_bus_call(struct coro_bus *bus, int channel, unsigned request,
+				  unsigned *reply, uint64_t timeout_usec)
 {
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (!coro_bus_channel_is_service(chan))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	uint64_t deadline = UINT64_MAX;
+	if (timeout_usec != 0)
+		deadline = coro_bus_time_usec() + timeout_usec;
+
+	bool is_lost = false;
+	int index = coro_bus_rpc_slot_take(bus, &is_lost);
+	if (index < 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	unsigned msg[2];
+	msg[0] = (bus->rpc_slots[index].generation << CORO_BUS_RPC_INDEX_BITS) |
+			 (unsigned)index;
+	msg[1] = request;
+
+	/* ID and request are sent atomically, so they always go in pair. */
+	int rc;
+	if (timeout_usec == 0)
+	{
+		rc = coro_bus_send_v_atomic(bus, channel, msg, 2);
+	}
+	else
+	{
+		/*
+		 * Without a reservation, so the timeout can't leave it
+		 * behind. Wait with the atomic senders, they are woken up
+		 * on any consumption while nobody holds a reservation.
+		 */
+		while ((rc = coro_bus_try_send_v_atomic(bus, channel, msg, 2)) < 0 &&
+			   (coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK ||
+				coro_bus_errno() == CORO_BUS_ERR_NO_BUDGET))
+		{
+			if (coro_bus_time_usec() >= deadline)
+			{
+				coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+				break;
+			}
+			/* The channel could be reopened while waiting. */
+			chan = bus->channels[channel];
+			coro_bus_channel_wait_send_until(chan, &chan->atomic_queue,
+											 deadline);
+		}
+	}
+	if (rc < 0)
+	{
+		coro_bus_rpc_slot_release(bus, index);
+		return -1;
+	}
+	bus->rpc_slots[index].channel = channel;
+
 	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
+	 * The caller sleeps until the reply or the deadline. The slots
+	 * array can be moved while waiting, so it is accessed by index
+	 * each time.
 	 */
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	while (true)
+	{
+		/* The slot is released already, the bus might be deleted. */
+		if (is_lost)
+		{
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (bus->rpc_slots[index].has_reply)
+			break;
+		if (coro_bus_time_usec() >= deadline)
+		{
+			coro_bus_rpc_slot_release(bus, index);
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		coro_suspend_until(deadline);
+	}
+	*reply = bus->rpc_slots[index].reply;
+	coro_bus_rpc_slot_release(bus, index);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_recv_request(struct coro_bus *bus, int channel, unsigned *id,
+						  unsigned *request)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (!coro_bus_channel_is_service(chan))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	unsigned msg[2];
+	int rc = coro_bus_recv_v(bus, channel, msg, 2);
+	if (rc < 0)
+		return -1;
+	/* Pairs are pushed atomically, so a service channel keeps them. */
+	if (rc != 2)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	*id = msg[0];
+	*request = msg[1];
+	return 0;
+}
+
+int coro_bus_try_recv_request(struct coro_bus *bus, int channel, unsigned *id,
+							  unsigned *request)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (!coro_bus_channel_is_service(chan))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	unsigned msg[2];
+	int rc = coro_bus_try_recv_v(bus, channel, msg, 2);
+	if (rc < 0)
+		return -1;
+	if (rc != 2)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	*id = msg[0];
+	*request = msg[1];
+	return 0;
+}
+
+int coro_bus_reply(struct coro_bus *bus, unsigned id, unsigned reply)
+{
+	unsigned index = id & (CORO_BUS_RPC_SLOTS_MAX - 1);
+	unsigned generation = id >> CORO_BUS_RPC_INDEX_BITS;
+	if (index >= bus->rpc_slot_count)
 	{
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	struct coro_bus_channel *chan = bus->channels[channel];
+	struct rpc_slot *slot = &bus->rpc_slots[index];
+	unsigned mask = UINT_MAX >> CORO_BUS_RPC_INDEX_BITS;
+	if (!slot->is_busy || slot->has_reply ||
+		(slot->generation & mask) != generation)
+	{
+		/* The caller has given up already. */
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	slot->reply = reply;
+	slot->has_reply = true;
+	coro_wakeup(slot->waiter);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+#endif
+
+struct coro_bus_pipeline *
+coro_bus_pipeline_new(struct coro_bus *bus, int head, int tail, size_t credits)
+{
+	struct coro_bus_channel *head_chan = coro_bus_channel_get(bus, head);
+	struct coro_bus_channel *tail_chan = coro_bus_channel_get(bus, tail);
+	if (head_chan == NULL || tail_chan == NULL)
+		return NULL;
+	/* Lossy heads never block, so they can't be held back by credits. */
+	if (head_chan->overflow != CORO_BUS_OVERFLOW_BLOCK ||
+		head_chan->head_of != NULL || tail_chan->tail_of != NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return NULL;
+	}
+	struct coro_bus_pipeline *p = malloc(sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->head = head_chan;
+	p->tail = tail_chan;
+	p->credits = credits;
+	/* What is already in the pipeline is not accounted. */
+	p->in_flight = 0;
+	head_chan->head_of = p;
+	tail_chan->tail_of = p;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return p;
+}
+
+void coro_bus_pipeline_delete(struct coro_bus_pipeline *p)
+{
+	if (p == NULL)
+		return;
+	if (p->tail != NULL)
+		p->tail->tail_of = NULL;
+	if (p->head != NULL)
+	{
+		p->head->head_of = NULL;
+		/* Without the credits the senders might fit now. */
+		coro_bus_channel_wakeup_senders(p->head);
+	}
+	free(p);
+}
+
+size_t coro_bus_pipeline_in_flight(const struct coro_bus_pipeline *p)
+{
+	return p->in_flight;
+}
+
+void coro_bus_pipeline_release(struct coro_bus_pipeline *p, size_t count)
+{
+	coro_bus_pipeline_put(p, count);
+}
+
+int coro_bus_link(struct coro_bus *bus, int src, int dst, coro_bus_link_f func,
+				  void *ctx)
+{
+	struct coro_bus_channel *src_chan = coro_bus_channel_get(bus, src);
+	struct coro_bus_channel *dst_chan = coro_bus_channel_get(bus, dst);
+	if (src_chan == NULL || dst_chan == NULL)
+		return -1;
+	/* Messages must not go round in circles. */
+	for (struct coro_bus_channel *it = dst_chan; it != NULL; it = it->link_dst)
+	{
+		if (it == src_chan)
+		{
+			coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+			return -1;
+		}
+	}
+	if (src_chan->link_dst != NULL)
+		rlist_del_entry(src_chan, in_link_sources);
+	src_chan->link_dst = dst_chan;
+	src_chan->link_func = func;
+	src_chan->link_ctx = ctx;
+	rlist_add_tail_entry(&dst_chan->link_sources, src_chan, in_link_sources);
+	/* The backpressure has changed, the senders might fit now. */
+	coro_bus_channel_wakeup_senders(src_chan);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_unlink(struct coro_bus *bus, int src)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, src);
+	if (chan == NULL)
+		return -1;
+	if (chan->link_dst != NULL)
+	{
+		rlist_del_entry(chan, in_link_sources);
+		chan->link_dst = NULL;
+		coro_bus_channel_wakeup_senders(chan);
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
+int coro_bus_channel_set_batch(struct coro_bus *bus, int channel,
+							   size_t max_count, uint64_t max_delay_usec)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (chan->is_conflating || chan->is_matching || chan->levels != NULL)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	coro_bus_channel_flush(chan);
+	chan->batch_max = max_count;
+	chan->batch_delay = max_delay_usec;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+int coro_bus_flush(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	coro_bus_channel_flush(chan);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+void coro_bus_set_deferred_wakeups(struct coro_bus *bus, bool is_deferred)
+{
+	if (is_deferred && !bus->is_wakeup_deferred)
+	{
+		if (deferred_bus_count++ == 0)
+			coro_set_switch_hook(coro_bus_wakeup_dirty);
+	}
+	else if (!is_deferred && bus->is_wakeup_deferred)
+	{
+		assert(deferred_bus_count > 0);
+		if (--deferred_bus_count == 0)
+			coro_set_switch_hook(NULL);
+	}
+	if (!is_deferred)
+		coro_bus_wakeup_dirty();
+	bus->is_wakeup_deferred = is_deferred;
+}
+
+int coro_bus_channel_set_window(struct coro_bus *bus, int channel,
+								const struct coro_bus_window_opts *opts)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (opts != NULL &&
+		(chan->is_conflating || chan->is_matching || chan->levels != NULL ||
+		 opts->op > CORO_BUS_WINDOW_MAX ||
+		 (opts->size == 0 && opts->period_usec == 0) ||
+		 (opts->slide != 0 && (opts->size == 0 || opts->period_usec != 0))))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return -1;
+	}
+	if (chan->window != NULL)
+	{
+		/* The started window is not lost. */
+		if (chan->window->slide == 0)
+			coro_bus_channel_window_close(chan);
+		coro_bus_channel_window_delete(chan);
+		coro_bus_channel_wakeup_recv(chan);
+	}
+	if (opts != NULL)
+	{
+		struct channel_window *w = calloc(1, sizeof(*w));
+		w->op = opts->op;
+		w->size = opts->size;
+		w->slide = opts->slide;
+		w->period = opts->period_usec;
+		if (w->slide != 0)
+		{
+			w->ring = calloc(w->size, sizeof(w->ring[0]));
+			w->deque = calloc(w->size, sizeof(w->deque[0]));
+		}
+		chan->window = w;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+/** How many messages a merge takes from an input at once. */
+enum
+{
+	CORO_BUS_MERGE_BATCH = 16,
+};
+
+/** An input channel of a merge with its buffered head messages. */
+struct merge_input
+{
+	int channel;
+	unsigned buf[CORO_BUS_MERGE_BATCH];
+	unsigned pos;
+	unsigned len;
+	bool is_closed;
+};
+
+struct coro_bus_merge
+{
+	struct coro_bus *bus;
+	struct merge_input *inputs;
+	size_t input_count;
+	/** Inputs having buffered messages, a min-heap by the head. */
+	size_t *heap;
+	size_t heap_size;
+};
+
+static bool
+merge_less(const struct coro_bus_merge *m, size_t a, size_t b)
+{
+	const struct merge_input *ia = &m->inputs[a];
+	const struct merge_input *ib = &m->inputs[b];
+	unsigned va = ia->buf[ia->pos];
+	unsigned vb = ib->buf[ib->pos];
+	/* Equal heads go in order of the inputs, so the merge is stable. */
+	return va < vb || (va == vb && a < b);
+}
+
+static void
+merge_sift_down(struct coro_bus_merge *m, size_t i)
+{
 	while (true)
 	{
-		if (coro_bus_try_send(bus, channel, data) == 0)
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		if (l < m->heap_size && merge_less(m, m->heap[l], m->heap[min]))
+			min = l;
+		if (r < m->heap_size && merge_less(m, m->heap[r], m->heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		size_t tmp = m->heap[i];
+		m->heap[i] = m->heap[min];
+		m->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void
+merge_push(struct coro_bus_merge *m, size_t input)
+{
+	size_t i = m->heap_size++;
+	m->heap[i] = input;
+	while (i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if (!merge_less(m, m->heap[i], m->heap[parent]))
+			return;
+		size_t tmp = m->heap[i];
+		m->heap[i] = m->heap[parent];
+		m->heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/**
+ * Refill the empty inputs from their channels. Returns how many
+ * open inputs are still empty.
+ */
+static size_t
+merge_refill(struct coro_bus_merge *m)
+{
+	size_t empty = 0;
+	for (size_t i = 0; i < m->input_count; ++i)
+	{
+		struct merge_input *in = &m->inputs[i];
+		if (in->is_closed || in->pos < in->len)
+			continue;
+		struct coro_bus_channel *chan =
+			coro_bus_channel_get(m->bus, in->channel);
+		if (chan == NULL)
 		{
-			return 0;
+			in->is_closed = true;
+			continue;
 		}
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		coro_bus_channel_prepare_recv(m->bus, chan);
+		size_t ready = coro_bus_channel_ready(chan);
+		uint64_t now = coro_bus_time_usec();
+		in->pos = 0;
+		in->len = 0;
+		while (in->len < CORO_BUS_MERGE_BATCH && in->len < ready &&
+			   coro_bus_channel_pop_live(chan, now, &in->buf[in->len]))
+			++in->len;
+		if (in->len == 0)
 		{
-			return -1;
+			++empty;
+			continue;
 		}
-		/* if  WOULD_BLOCK — block current corotine */
-		wakeup_queue_suspend_this(&chan->send_queue);
+		coro_bus_channel_wakeup_senders(chan);
+		wakeup_queue_wakeup_first(&m->bus->broadcast_queue);
+		merge_push(m, i);
 	}
+	return empty;
 }
 
-int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+struct coro_bus_merge *
+coro_bus_merge_new(struct coro_bus *bus, const int *channels, size_t count)
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
-	}
-
-	struct coro_bus_channel *chan = bus->channels[channel];
+	struct coro_bus_merge *m = malloc(sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	m->bus = bus;
+	m->inputs = calloc(count, sizeof(m->inputs[0]));
+	m->heap = malloc(count * sizeof(m->heap[0]));
+	m->input_count = count;
+	m->heap_size = 0;
+	for (size_t i = 0; i < count; ++i)
+		m->inputs[i].channel = channels[i];
+	return m;
+}
 
-	if (chan->data.size < chan->size_limit)
-	{
-		data_vector_append(&chan->data, data);
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		wakeup_queue_wakeup_all(&chan->recv_queue);
-		return 0;
-	}
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-	return -1;
+void coro_bus_merge_delete(struct coro_bus_merge *m)
+{
+	if (m == NULL)
+		return;
+	free(m->inputs);
+	free(m->heap);
+	free(m);
 }
 
-int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+int coro_bus_merge_try_next(struct coro_bus_merge *m, unsigned *data)
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	/* The smallest head is known only when every input has one. */
+	if (merge_refill(m) > 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (m->heap_size == 0)
 	{
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	struct coro_bus_channel *chan = bus->channels[channel];
+	struct merge_input *in = &m->inputs[m->heap[0]];
+	*data = in->buf[in->pos++];
+	if (in->pos == in->len)
+		m->heap[0] = m->heap[--m->heap_size];
+	merge_sift_down(m, 0);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
+int coro_bus_merge_next(struct coro_bus_merge *m, unsigned *data)
+{
 	while (true)
 	{
-		if (coro_bus_try_recv(bus, channel, data) == 0)
-		{
+		if (coro_bus_merge_try_next(m, data) == 0)
 			return 0;
-		}
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-		{
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
+		/* Wait for any of the empty inputs to get data. */
+		struct wakeup_queue **queues =
+			malloc(m->input_count * sizeof(queues[0]));
+		size_t count = 0;
+		uint64_t deadline = UINT64_MAX;
+		for (size_t i = 0; i < m->input_count; ++i)
+		{
+			struct merge_input *in = &m->inputs[i];
+			if (in->is_closed || in->pos < in->len)
+				continue;
+			struct coro_bus_channel *chan = m->bus->channels[in->channel];
+			/* Nobody wakes up the receivers waiting for tokens. */
+			uint64_t when = coro_bus_channel_next_event(chan);
+			if (when < deadline)
+				deadline = when;
+			++chan->recv_blocks;
+			++chan->window_recv_blocks;
+			queues[count++] = &chan->recv_queue;
 		}
-		/* if  WOULD_BLOCK — block current corotine */
-		wakeup_queue_suspend_this(&chan->recv_queue);
+		wakeup_queue_suspend_this_any(queues, count, deadline);
+		free(queues);
 	}
 }
 
-int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+/**
+ * Take the oldest message with the key out of a matching channel.
+ * It is found by its sequence number, the numbers of the messages
+ * in the channel only grow. The messages after it are shifted,
+ * like on any pop. The channel must have a message with the key.
+ */
+static unsigned
+coro_bus_channel_take_match(struct coro_bus_channel *chan, unsigned key)
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	struct key_index_entry *e = key_index_find(&chan->index, key);
+	assert(e != NULL && e->match->count > 0);
+	size_t pos;
+	while (true)
 	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+		uint64_t seq = seq_fifo_pop(&e->match->seqs);
+		size_t begin = 0;
+		size_t end = chan->size;
+		while (begin < end)
+		{
+			size_t mid = begin + (end - begin) / 2;
+			if (chan->seqs.data[mid] < seq)
+				begin = mid + 1;
+			else
+				end = mid;
+		}
+		pos = begin;
+		/* Not found means it has expired, the number is stale. */
+		if (pos < chan->size && chan->seqs.data[pos] == seq)
+			break;
 	}
-
-	struct coro_bus_channel *chan = bus->channels[channel];
-
-	if (chan->data.size > 0)
+	--e->match->count;
+	coro_bus_channel_match_put(chan, e);
+	unsigned data = chan->data.data[pos];
+	size_t tail = chan->size - pos - 1;
+	memmove(&chan->data.data[pos], &chan->data.data[pos + 1],
+			tail * sizeof(chan->data.data[0]));
+	memmove(&chan->keys.data[pos], &chan->keys.data[pos + 1],
+			tail * sizeof(chan->keys.data[0]));
+	memmove(&chan->seqs.data[pos], &chan->seqs.data[pos + 1],
+			tail * sizeof(chan->seqs.data[0]));
+	--chan->data.size;
+	--chan->keys.size;
+	--chan->seqs.size;
+	if (chan->has_deadlines)
 	{
-		unsigned int value = data_vector_pop_first(&chan->data);
-		*data = value;
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		wakeup_queue_wakeup_first(&chan->send_queue);
-		wakeup_queue_wakeup_first(&bus->broadcast_queue);
-		return 0;
+		memmove(&chan->deadlines.data[pos], &chan->deadlines.data[pos + 1],
+				tail * sizeof(chan->deadlines.data[0]));
+		--chan->deadlines.size;
 	}
-
-	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-	return -1;
+	if (chan->rate != 0)
+		chan->tokens -= CORO_BUS_TOKEN;
+	--chan->size;
+	--chan->bus->used;
+	++chan->popped;
+	coro_bus_channel_note_op(chan);
+	coro_bus_channel_note_out(chan, 1);
+	return data;
 }
 
-#if NEED_BROADCAST
-
-int coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+int coro_bus_recv_match(struct coro_bus *bus, int channel, unsigned key,
+						unsigned *data)
 {
-	if (!bus || bus->channel_count == 0)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
 		return -1;
-	}
 
 	while (true)
 	{
-		if (coro_bus_try_broadcast(bus, data) == 0)
+		if (coro_bus_try_recv_match(bus, channel, key, data) == 0)
 			return 0;
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
-		wakeup_queue_suspend_this(&bus->broadcast_queue);
+		/*
+		 * Nobody brings the delayed messages and the tokens. The
+		 * tokens matter only when the key has messages.
+		 */
+		uint64_t deadline = coro_bus_channel_next_timer(chan);
+		if (coro_bus_channel_match_count(chan, key) > 0)
+		{
+			uint64_t when = coro_bus_channel_next_token(chan);
+			if (when < deadline)
+				deadline = when;
+		}
+		struct match_key *m = coro_bus_channel_match_get(chan, key);
+		struct wakeup_entry w;
+		w.coro = coro_this();
+		rlist_add_tail_entry(&m->waiters.coros, &w, base);
+		++m->waiters.count;
+		++chan->match_waiters;
+		++chan->recv_blocks;
+		++chan->window_recv_blocks;
+		coro_suspend_until(deadline);
+		/* The channel deletion takes the waiter out of the queue. */
+		if (!rlist_empty(&w.base))
+		{
+			rlist_del_entry(&w, base);
+			--m->waiters.count;
+			--chan->match_waiters;
+			coro_bus_channel_match_put(chan,
+									   key_index_find(&chan->index, key));
+		}
 	}
 }
 
-int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+int coro_bus_try_recv_match(struct coro_bus *bus, int channel, unsigned key,
+							unsigned *data)
 {
-	if (!bus || bus->channel_count == 0)
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (!chan->is_matching)
 	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
 		return -1;
 	}
-
-	bool any = false;
-
-	for (int id = 0; id < bus->channel_count; ++id)
+	coro_bus_channel_prepare_recv(bus, chan);
+	if (coro_bus_channel_match_count(chan, key) == 0 ||
+		coro_bus_channel_ready(chan) == 0)
 	{
-		struct coro_bus_channel *chan = bus->channels[id];
-		if (!chan)
-			continue;
-		any = true;
-		if (chan->data.size >= chan->size_limit)
-		{
-			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-			return -1;
-		}
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
 	}
+	*data = coro_bus_channel_take_match(chan, key);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	coro_bus_channel_wakeup_senders(chan);
+	wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	return 0;
+}
 
-	if (!any)
+int coro_bus_channel_set_rate(struct coro_bus *bus, int channel,
+							  uint64_t rate, uint64_t burst)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (burst == 0)
+		burst = 1;
+	if (rate != 0 && burst > UINT64_MAX / CORO_BUS_TOKEN)
 	{
-		/* If all channels were null */
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
 		return -1;
 	}
+	/* A new bucket starts full. */
+	chan->rate = rate;
+	chan->burst = burst;
+	chan->tokens = burst * CORO_BUS_TOKEN;
+	chan->refill_time = coro_bus_time_usec();
+	/* The messages held back by the old limit might be ready now. */
+	coro_bus_channel_wakeup_recv(chan);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-	for (int id = 0; id < bus->channel_count; ++id)
+int coro_bus_channel_set_dedup(struct coro_bus *bus, int channel,
+							   size_t size)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return -1;
+	channel_dedup_delete(chan->dedup);
+	chan->dedup = NULL;
+	if (size != 0)
 	{
-		if (!bus->channels[id])
-			continue;
-		data_vector_append(&bus->channels[id]->data, data);
-		wakeup_queue_wakeup_first(&bus->channels[id]->recv_queue);
+		struct channel_dedup *dedup = calloc(1, sizeof(*dedup));
+		dedup->ring = malloc(size * sizeof(dedup->ring[0]));
+		dedup->size = size;
+		chan->dedup = dedup;
 	}
-
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
 
-#endif
-
-#if NEED_BATCH
-
-int coro_bus_try_send_v(struct coro_bus *bus, int channel,
-						const unsigned *data, unsigned count)
+/** Find the message in flight by its tag. NULL if it is done. */
+static struct ack_entry *
+coro_bus_channel_acks_find(struct coro_bus_channel *chan, uint64_t tag)
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
+	struct ack_vector *acks = &chan->acks;
+	size_t lo = 0;
+	size_t hi = acks->size;
+	while (lo < hi)
 	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+		size_t mid = lo + (hi - lo) / 2;
+		if (acks->data[mid].tag < tag)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	struct coro_bus_channel *chan = bus->channels[channel];
+	if (lo == acks->size || acks->data[lo].tag != tag ||
+		acks->data[lo].is_done)
+		return NULL;
+	return &acks->data[lo];
+}
 
-	unsigned avail = chan->size_limit - chan->data.size;
-	if (avail == 0)
+/** Get a channel which is in the ack mode. */
+static struct coro_bus_channel *
+coro_bus_channel_get_acked(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
+		return NULL;
+	if (!chan->is_acked)
 	{
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return NULL;
 	}
-
-	unsigned to_send = count < avail ? count : avail;
-
-	data_vector_append_many(&chan->data, data, to_send);
-
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	wakeup_queue_wakeup_all(&chan->recv_queue);
-
-	return to_send; 
+	return chan;
 }
 
-int coro_bus_send_v(struct coro_bus *bus, int channel,
-					const unsigned *data, unsigned count)
+int coro_bus_recv_ack(struct coro_bus *bus, int channel, unsigned *data,
+					  uint64_t *tag)
 {
-	if (!bus || channel < 0 || channel >= bus->channel_count || bus->channels[channel] == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_channel *chan = coro_bus_channel_get(bus, channel);
+	if (chan == NULL)
 		return -1;
-	}
-	struct coro_bus_channel *chan = bus->channels[channel];
 
-	/* 2) Пытаемся до тех пор, пока хоть что-то не отправим или не увидим NO_CHANNEL */
-	/* Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as long as there is still space.
-	 */
 	while (true)
 	{
-		int sent = coro_bus_try_send_v(bus, channel, data, count);
-		if (sent > 0)
-		{
-			return sent;
-		}
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-		{
+		if (coro_bus_try_recv_ack(bus, channel, data, tag) == 0)
+			return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
-		}
-		/* If WOULD_BLOCK, suspend current coroutine */
-		wakeup_queue_suspend_this(&chan->send_queue);
+		coro_bus_channel_wait_recv(chan);
 	}
 }
 
-int coro_bus_try_recv_v(struct coro_bus *bus, int ch,
-						unsigned *out, unsigned capacity)
+int coro_bus_try_recv_ack(struct coro_bus *bus, int channel, unsigned *data,
+						  uint64_t *tag)
 {
-	if (!bus || ch < 0 || ch >= bus->channel_count || bus->channels[ch] == NULL)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_channel *chan = coro_bus_channel_get_acked(bus, channel);
+	if (chan == NULL)
 		return -1;
-	}
-	struct coro_bus_channel *chan = bus->channels[ch];
-
-	unsigned got = 0;
-	while (got < capacity)
-	{
-		if (chan->data.size > 0)
-		{
-			/* Take the first element */
-			unsigned val = data_vector_pop_first(&chan->data);
-			out[got++] = val;
-			/* If we have space, wakeup the first waiting sender */
-			wakeup_queue_wakeup_first(&chan->send_queue);
-		}
-		else
-		{
-			break;
-		}
-	}
-
-	if (got > 0)
-	{
-		coro_bus_errno_set(CORO_BUS_ERR_NONE);
-		return got;
-	}
-	else
+	coro_bus_channel_prepare_recv(bus, chan);
+	if (coro_bus_channel_ready(chan) == 0)
 	{
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
+	struct ack_vector *acks = &chan->acks;
+	if (acks->size == acks->capacity)
+	{
+		acks->capacity = acks->capacity == 0 ? 4 : acks->capacity * 2;
+		acks->data = realloc(acks->data,
+							 sizeof(acks->data[0]) * acks->capacity);
+	}
+	struct ack_entry *e = &acks->data[acks->size++];
+	e->tag = chan->next_tag++;
+	e->deadline = chan->ack_timeout != 0 ?
+		coro_bus_time_usec() + chan->ack_timeout : UINT64_MAX;
+	e->owner = coro_this();
+	e->is_done = false;
+	e->data = coro_bus_channel_pop(chan);
+	/* The message keeps its space while in flight. */
+	++chan->unacked;
+	++bus->used;
+	/* The receivers sleep until the first message in flight is due. */
+	if (chan->unacked == 1 && chan->ack_timeout != 0)
+		coro_bus_channel_wakeup_recv(chan);
+	*data = e->data;
+	*tag = e->tag;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
 }
 
-int coro_bus_recv_v(struct coro_bus *bus, int ch,
-					unsigned *out, unsigned capacity)
+int coro_bus_ack(struct coro_bus *bus, int channel, uint64_t tag)
 {
-	if (!bus || ch < 0 || ch >= bus->channel_count || bus->channels[ch] == NULL)
+	struct coro_bus_channel *chan = coro_bus_channel_get_acked(bus, channel);
+	if (chan == NULL)
+		return -1;
+	struct ack_entry *e = coro_bus_channel_acks_find(chan, tag);
+	if (e == NULL)
 	{
+		/* Already acked, or delivered again after a timeout. */
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	struct coro_bus_channel *chan = bus->channels[ch];
+	e->is_done = true;
+	--chan->unacked;
+	--bus->used;
+	coro_bus_channel_acks_compact(chan);
+	coro_bus_channel_wakeup_senders(chan);
+	wakeup_queue_wakeup_first(&bus->broadcast_queue);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
 
-	unsigned total = 0;
-	while (total < capacity)
+int coro_bus_ack_upto(struct coro_bus *bus, int channel, uint64_t tag)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get_acked(bus, channel);
+	if (chan == NULL)
+		return -1;
+	struct ack_vector *acks = &chan->acks;
+	struct coro *self = coro_this();
+	size_t count = 0;
+	for (size_t i = 0; i < acks->size && acks->data[i].tag <= tag; ++i)
 	{
-		int rc = coro_bus_try_recv_v(bus, ch, out + total, capacity - total);
-		if (rc > 0)
-		{
-			total += rc;
-			/* If buffer is still not empty, try again */
-			continue;
-		}
-		if (coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
-		{
-			return -1;
-		}
-		/* WOULD_BLOCK and at the same time we have not taken any yet —
-		block, and after waking up we will try again */
-		if (total == 0)
-		{
-			wakeup_queue_suspend_this(&chan->recv_queue);
+		struct ack_entry *e = &acks->data[i];
+		if (e->is_done || e->owner != self)
 			continue;
-		}
-		break;
+		e->is_done = true;
+		++count;
+	}
+	chan->unacked -= count;
+	bus->used -= count;
+	coro_bus_channel_acks_compact(chan);
+	if (count > 0)
+	{
+		coro_bus_channel_wakeup_senders(chan);
+		wakeup_queue_wakeup_first(&bus->broadcast_queue);
 	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return count;
+}
 
+int coro_bus_nack_all(struct coro_bus *bus, int channel, struct coro *consumer)
+{
+	struct coro_bus_channel *chan = coro_bus_channel_get_acked(bus, channel);
+	if (chan == NULL)
+		return -1;
+	if (consumer == NULL)
+		consumer = coro_this();
+	size_t old = chan->unacked;
+	coro_bus_channel_acks_return(chan, consumer, UINT64_MAX);
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return total;
+	return old - chan->unacked;
+}
+
+void coro_bus_set_budget(struct coro_bus *bus, size_t budget)
+{
+	bus->budget = budget;
+	/* The senders waiting for the old budget might fit now. */
+	wakeup_queue_wakeup_all(&bus->budget_queue);
 }
 
-#endif
\ No newline at end of file
+size_t coro_bus_usage(struct coro_bus *bus)
+{
+	return bus->used;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which bonuses do you want via the
@@ -15,9 +17,183 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_TIMEOUT,
+	CORO_BUS_ERR_NO_BUDGET,
 };
 
 struct coro_bus;
+struct coro_bus_partition;
+struct coro_bus_dispatcher;
+struct coro_future;
+struct coro_bus_pipeline;
+struct coro_bus_merge;
+struct coro;
+
+/**
+ * Transform of a message passing through a link. The message can
+ * be changed in place.
+ * @retval true Forward the message.
+ * @retval false Drop the message.
+ */
+typedef bool (*coro_bus_link_f)(void *ctx, unsigned *data);
+
+/** Max number of priority levels in a channel. */
+#define CORO_BUS_PRIO_MAX 8
+
+/** What a channel does when a message doesn't fit into it. */
+enum coro_bus_overflow {
+	/** The sender waits for space, or gets WOULD_BLOCK. */
+	CORO_BUS_OVERFLOW_BLOCK = 0,
+	/** The new message is dropped. */
+	CORO_BUS_OVERFLOW_DROP_NEWEST,
+	/** The oldest message is dropped to make space. */
+	CORO_BUS_OVERFLOW_DROP_OLDEST,
+};
+
+/** Channel settings, fixed at the channel creation. */
+struct coro_bus_channel_opts {
+	/** Maximum messages a channel can hold in memory at once. */
+	size_t size_limit;
+	/**
+	 * Overflow policy. With any policy except BLOCK sending
+	 * never suspends and never fails due to the channel being
+	 * full.
+	 */
+	enum coro_bus_overflow overflow;
+	/**
+	 * Keep only the latest pending message for each key. A new
+	 * message replaces the pending one with the same key in
+	 * place, without taking new space and without changing its
+	 * position in the queue. So the channel never holds more
+	 * messages than there are different keys. Messages sent
+	 * without a key are their own keys.
+	 */
+	bool is_conflating;
+	/**
+	 * Keep the keys of all the pending messages indexed, so
+	 * coro_bus_recv_match() can take the next message with a
+	 * given key out of the middle of the queue. Messages sent
+	 * without a key are their own keys. Can't be used with
+	 * conflating or priorities.
+	 */
+	bool is_matching;
+	/**
+	 * Ack mode. Messages received with coro_bus_recv_ack() stay
+	 * in flight, taking space, until acknowledged. Those not
+	 * acknowledged in time or given back are delivered again,
+	 * before the other messages. Usual receives take messages
+	 * acknowledged right away. Can't be used with conflating,
+	 * matching or priorities.
+	 */
+	bool is_acked;
+	/**
+	 * How long a message can be in flight, in microseconds. 0
+	 * means until it is acknowledged or given back.
+	 */
+	uint64_t ack_timeout_usec;
+	/**
+	 * Number of priority levels, up to CORO_BUS_PRIO_MAX. Each
+	 * level has its own queue, and the receivers take messages
+	 * from the higher levels first. Level 0 is the highest.
+	 * Messages sent without a priority get the lowest one. 0 or
+	 * 1 means a usual channel. Can't be used with conflating.
+	 */
+	unsigned prio_levels;
+	/**
+	 * By default a receiver always takes the highest priority
+	 * message. When weighted, each level in its turn can give
+	 * only prio_weights[level] messages, then the next non-empty
+	 * level is served. So the lower levels are not starved.
+	 */
+	bool is_prio_weighted;
+	/**
+	 * Weights of the levels for the weighted dequeue. 0 means the
+	 * default, when each level is worth twice the next one.
+	 */
+	unsigned prio_weights[CORO_BUS_PRIO_MAX];
+	/**
+	 * Default time to live of the messages in microseconds. A
+	 * message not received in time is dropped. 0 means the
+	 * messages live forever. Can't be used with priorities.
+	 */
+	uint64_t ttl_usec;
+};
+
+/** How a channel window reduces the messages into a summary. */
+enum coro_bus_window_op {
+	/** Number of the messages. */
+	CORO_BUS_WINDOW_COUNT = 0,
+	/** Sum of the messages, modulo UINT_MAX + 1. */
+	CORO_BUS_WINDOW_SUM,
+	CORO_BUS_WINDOW_MIN,
+	CORO_BUS_WINDOW_MAX,
+};
+
+/** Settings of a channel window. */
+struct coro_bus_window_opts {
+	enum coro_bus_window_op op;
+	/** Messages in a window. 0 means the window is by time only. */
+	size_t size;
+	/**
+	 * Length of a tumbling window in microseconds since its first
+	 * message. 0 means the window is by size only. When both are
+	 * set, the window ends by whichever comes first.
+	 */
+	uint64_t period_usec;
+	/**
+	 * 0 means a tumbling window, each message gets into one
+	 * summary. Otherwise it is a sliding window by size: each
+	 * slide messages a summary of the last size messages is
+	 * emitted. Sliding windows by time are not supported.
+	 */
+	size_t slide;
+};
+
+/** An array of messages owned by the user. */
+struct coro_bus_buffer {
+	/** Messages. Allocated with malloc(), freed with free(). */
+	unsigned *data;
+	/** Count of messages in the buffer. */
+	size_t size;
+	/** How many messages fit into the allocated memory. */
+	size_t capacity;
+};
+
+/** Snapshot of a channel state. */
+struct coro_bus_channel_stat {
+	/** Messages in the channel now. */
+	size_t size;
+	/** Maximum messages the channel can hold. */
+	size_t size_limit;
+	/**
+	 * Coroutines suspended until the channel has space. The ones
+	 * waiting for the bus budget are not counted, they wait for
+	 * the bus and not for a channel.
+	 */
+	size_t send_waiters;
+	/** Coroutines suspended until the channel has data. */
+	size_t recv_waiters;
+	/** The biggest size the channel ever had. */
+	size_t high_watermark;
+	/** How many times senders were suspended on the channel. */
+	size_t send_blocks;
+	/** How many times receivers were suspended on the channel. */
+	size_t recv_blocks;
+	/** How many messages were dropped due to the overflow policy. */
+	size_t dropped;
+	/** How many messages were replaced by newer ones with same key. */
+	size_t conflated;
+	/** How many messages expired before being received. */
+	size_t expired;
+	/** Messages scheduled for delivery but not delivered yet. */
+	size_t delayed;
+	/** Sent messages held back until the batch is flushed. */
+	size_t batched;
+	/** How many messages were dropped as duplicates. */
+	size_t deduplicated;
+	/** Received messages waiting to be acknowledged. */
+	size_t in_flight;
+};
 
 /** Get the latest error happened in coro_bus. */
 enum coro_bus_error_code
@@ -51,6 +227,18 @@ coro_bus_delete(struct coro_bus *bus);
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Same as coro_bus_channel_open(), but with more settings.
+ * @param bus The bus to create the channel in.
+ * @param opts Settings of the channel. Zeroed fields mean the
+ *     defaults.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_opts(struct coro_bus *bus,
+	const struct coro_bus_channel_opts *opts);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -62,6 +250,61 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel);
 
+/**
+ * Change the maximum size of the channel. Pending messages are
+ * kept, even if the new limit is smaller than their count - then
+ * new messages can't be sent until enough are consumed. When the
+ * limit grows, as many blocked senders are woken up as the new
+ * space allows.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param size_limit New maximum messages the channel can hold.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_set_limit(struct coro_bus *bus, int channel,
+	size_t size_limit);
+
+/**
+ * Let the channel tune its size limit automatically within the
+ * given bounds. The channel watches how often its senders and
+ * receivers get suspended. When the senders block often, the
+ * limit grows. When they don't block, and the space is mostly
+ * unused, the limit shrinks and the unused memory is freed.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param min_limit The limit never gets lower than that.
+ * @param max_limit The limit never gets higher than that. 0 turns
+ *     the adaptive mode off and leaves the current limit as is.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the min is bigger than the
+ *       max.
+ */
+int
+coro_bus_channel_set_adaptive(struct coro_bus *bus, int channel,
+	size_t min_limit, size_t max_limit);
+
+/**
+ * Get the current state of the channel. Takes constant time, the
+ * counters are maintained along with the channel operations.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param stat Output parameter to save the state to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stat(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stat *stat);
+
 /**
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
@@ -89,10 +332,111 @@ coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
  */
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
 
+/**
+ * Same as coro_bus_send(), but the message has the given priority
+ * in a priority channel. Usual channels ignore it.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param prio Priority level, 0 is the highest. Too big levels
+ *     mean the lowest one.
+ * @param data Data to send.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	unsigned data);
+
+/**
+ * Same as coro_bus_send_prio(), but if the channel is full, the
+ * function immediately returns.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param prio Priority level, 0 is the highest.
+ * @param data Data to send.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ */
+int
+coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	unsigned data);
+
+/**
+ * Same as coro_bus_send(), but the message lives only for the
+ * given time. If it is not received by then, it is dropped.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ * @param ttl_usec Time to live in microseconds. 0 means the
+ *     default of the channel.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - it is a priority channel.
+ */
+int
+coro_bus_send_ttl(struct coro_bus *bus, int channel, unsigned data,
+	uint64_t ttl_usec);
+
+/**
+ * Same as coro_bus_send_ttl(), but if the channel is full, the
+ * function immediately returns.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ * @param ttl_usec Time to live in microseconds.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - it is a priority channel.
+ */
+int
+coro_bus_try_send_ttl(struct coro_bus *bus, int channel, unsigned data,
+	uint64_t ttl_usec);
+
+/**
+ * Current time of the bus clock in microseconds. The clock is
+ * monotonic, its start point is unspecified.
+ */
+uint64_t
+coro_bus_time_usec(void);
+
+/**
+ * Schedule a message to be sent to the channel at the given time.
+ * The function never blocks. The message is kept by the bus and
+ * is delivered when any receive on the bus finds it is due and
+ * the channel has space. Receivers of a channel with scheduled
+ * messages sleep until the nearest of them is due. If the
+ * channel is closed earlier, the message is dropped.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ * @param when_usec Time by coro_bus_time_usec() when the message
+ *     should be delivered. Past time means as soon as possible.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_at(struct coro_bus *bus, int channel, unsigned data,
+	uint64_t when_usec);
+
 /**
  * Recv a message from the specified channel. If the channel is
  * empty, the function should suspend the current coroutine and
@@ -127,6 +471,203 @@ int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
 
+/**
+ * Same as coro_bus_send(), but the message has a key. The key is
+ * used by conflating channels, others ignore it.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param key Key of the message.
+ * @param data Data to send.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_keyed(struct coro_bus *bus, int channel, unsigned key,
+	unsigned data);
+
+/**
+ * Same as coro_bus_send_keyed(), but if the channel is full, the
+ * function immediately returns. Replacing a pending message of a
+ * conflating channel never fails.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param key Key of the message.
+ * @param data Data to send.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ */
+int
+coro_bus_try_send_keyed(struct coro_bus *bus, int channel, unsigned key,
+	unsigned data);
+
+/**
+ * Same as coro_bus_recv(), but returns the key of the message
+ * too. Works only for the channels which keep the keys.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param key Output parameter to save the key to.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel doesn't keep
+ *       the keys.
+ */
+int
+coro_bus_recv_keyed(struct coro_bus *bus, int channel, unsigned *key,
+	unsigned *data);
+
+/**
+ * Same as coro_bus_recv_keyed(), but if the channel is empty, the
+ * function immediately returns.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param key Output parameter to save the key to.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel doesn't keep
+ *       the keys.
+ */
+int
+coro_bus_try_recv_keyed(struct coro_bus *bus, int channel, unsigned *key,
+	unsigned *data);
+
+/**
+ * Receive the oldest message with the given key, skipping the
+ * messages with other keys. They stay in the queue in their
+ * order. If there is no such message, the current coroutine is
+ * suspended until one is sent. Only the receivers waiting for
+ * that key are woken up then. Works only for the matching
+ * channels.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param key Key of the message to receive.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not
+ *       matching.
+ */
+int
+coro_bus_recv_match(struct coro_bus *bus, int channel, unsigned key,
+	unsigned *data);
+
+/**
+ * Same as coro_bus_recv_match(), but if there is no message with
+ * the key, the function immediately returns.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param key Key of the message to receive.
+ * @param data Output parameter to save the data to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no message with the key.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not
+ *       matching.
+ */
+int
+coro_bus_try_recv_match(struct coro_bus *bus, int channel, unsigned key,
+	unsigned *data);
+
+/**
+ * Receive a message from a channel in the ack mode. The message
+ * stays in flight until it is acknowledged with its tag. Tags of
+ * the messages grow in the order of receipt.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param data Output parameter to save the data to.
+ * @param tag Output parameter to save the delivery tag to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not in the
+ *       ack mode.
+ */
+int
+coro_bus_recv_ack(struct coro_bus *bus, int channel, unsigned *data,
+	uint64_t *tag);
+
+/**
+ * Same as coro_bus_recv_ack(), but if the channel is empty, the
+ * function immediately returns.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not in the
+ *       ack mode.
+ */
+int
+coro_bus_try_recv_ack(struct coro_bus *bus, int channel, unsigned *data,
+	uint64_t *tag);
+
+/**
+ * Acknowledge one message in flight. Its space is freed.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param tag Delivery tag of the message.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist, or
+ *       the message is not in flight anymore.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not in the
+ *       ack mode.
+ */
+int
+coro_bus_ack(struct coro_bus *bus, int channel, uint64_t tag);
+
+/**
+ * Acknowledge all the messages in flight received by the current
+ * coroutine with tags up to the given one, inclusive. So a whole
+ * batch of messages takes one ack.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param tag Delivery tag of the last message to acknowledge.
+ *
+ * @retval >=0 How many messages were acknowledged.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not in the
+ *       ack mode.
+ */
+int
+coro_bus_ack_upto(struct coro_bus *bus, int channel, uint64_t tag);
+
+/**
+ * Give back all the messages in flight received by a consumer,
+ * when it is cancelled. They are delivered again before the other
+ * messages of the channel.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param consumer Coroutine which received the messages. NULL
+ *     means the current one.
+ *
+ * @retval >=0 How many messages were given back.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is not in the
+ *       ack mode.
+ */
+int
+coro_bus_nack_all(struct coro_bus *bus, int channel, struct coro *consumer);
+
 #if NEED_BROADCAST /* Bonus 1 */
 
 /**
@@ -154,6 +695,7 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
  *     - CORO_BUS_ERR_WOULD_BLOCK - at least one channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
  */
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
@@ -197,11 +739,52 @@ coro_bus_send_v(struct coro_bus *bus, int channel,
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
  */
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel,
 	const unsigned *data, unsigned count);
 
+/**
+ * Same as coro_bus_send_v(), but sends either all the messages or
+ * none. The coroutine is suspended until the whole batch fits,
+ * and then the messages are enqueued contiguously, not
+ * interleaved with the messages of other senders. A blocked
+ * atomic sender reserves space in the channel, so the other
+ * senders can't starve it by taking every freed slot.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ *
+ * @retval >=0 Success, all @a count messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - @a count is bigger than the
+ *       channel size limit, so the batch would never fit.
+ */
+int
+coro_bus_send_v_atomic(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count);
+
+/**
+ * Same as coro_bus_send_v_atomic(), but fails instantly in case
+ * the channel doesn't have space for the whole batch.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ *
+ * @retval >=0 Success, all @a count messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the batch doesn't fit.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ */
+int
+coro_bus_try_send_v_atomic(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count);
+
 /**
  * Same as coro_bus_recv(), but can receive multiple messages at
  * once. If the channel is empty, then the coroutine is suspended
@@ -244,4 +827,527 @@ int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
+/**
+ * Take all the messages of the channel at once without copying
+ * them. The channel's storage is exchanged with the given empty
+ * buffer, which becomes the new storage of the channel (its
+ * memory is reused, if any). The buffer gets the old storage
+ * with all the messages, oldest first. The expired messages are
+ * dropped from it, so it can have less data than its capacity.
+ * The blocked senders are woken up once. Never suspends.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to drain.
+ * @param buffer Empty buffer on input, drained messages on
+ *     output. The user owns the memory.
+ *
+ * @retval >0 Success, how many messages were drained.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the buffer is not empty, or
+ *       the channel has priorities or a rate limit.
+ */
+int
+coro_bus_drain_swap(struct coro_bus *bus, int channel,
+	struct coro_bus_buffer *buffer);
+
 #endif /* Bonus 2 */
+
+/**
+ * Create a partitioned channel set on the bus. It spreads keyed
+ * messages over its member channels by consistent hashing. All
+ * messages with the same key go to the same member while the set
+ * of members stays the same. Adding or removing a member moves
+ * only the keys of about one member's share.
+ * The partition must be deleted before the bus.
+ */
+struct coro_bus_partition *
+coro_bus_partition_new(struct coro_bus *bus);
+
+/** Delete the partition. The member channels stay open. */
+void
+coro_bus_partition_delete(struct coro_bus_partition *p);
+
+/**
+ * Add a channel to the partition members. Adding a member twice
+ * does nothing.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_partition_add(struct coro_bus_partition *p, int channel);
+
+/**
+ * Remove a channel from the partition members. Its keys are
+ * spread over the rest of the members. The pending messages stay
+ * in the channel.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is not a member.
+ */
+int
+coro_bus_partition_remove(struct coro_bus_partition *p, int channel);
+
+/**
+ * Find the member channel owning the key.
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the partition has no members.
+ */
+int
+coro_bus_partition_route(const struct coro_bus_partition *p, unsigned key);
+
+/**
+ * Send a message to the member channel owning the key, the same
+ * as coro_bus_send_keyed() to that channel.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no members or the channel was
+ *       closed.
+ */
+int
+coro_bus_partition_send_keyed(struct coro_bus_partition *p, unsigned key,
+	unsigned data);
+
+/**
+ * Same as coro_bus_partition_send_keyed(), but if the channel is
+ * full, the function immediately returns.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no members or the channel was
+ *       closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ */
+int
+coro_bus_partition_try_send_keyed(struct coro_bus_partition *p, unsigned key,
+	unsigned data);
+
+/**
+ * Create a dispatcher on the bus. It balances messages over its
+ * member channels: each message goes to the member with the
+ * fewest pending messages among the ones having space. Ties are
+ * resolved round robin. There is no ordering between members.
+ * The dispatcher must be deleted before the bus.
+ */
+struct coro_bus_dispatcher *
+coro_bus_dispatcher_new(struct coro_bus *bus);
+
+/** Delete the dispatcher. The member channels stay open. */
+void
+coro_bus_dispatcher_delete(struct coro_bus_dispatcher *d);
+
+/**
+ * Add a channel to the dispatcher members. Adding a member twice
+ * does nothing. Closed members are skipped.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_dispatcher_add(struct coro_bus_dispatcher *d, int channel);
+
+/**
+ * Remove a channel from the dispatcher members.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is not a member.
+ */
+int
+coro_bus_dispatcher_remove(struct coro_bus_dispatcher *d, int channel);
+
+/**
+ * Send a message to the least loaded member. If all of them are
+ * full, the function suspends the current coroutine until some
+ * member has space.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no open members.
+ */
+int
+coro_bus_dispatcher_send(struct coro_bus_dispatcher *d, unsigned data);
+
+/**
+ * Same as coro_bus_dispatcher_send(), but if all the members are
+ * full, the function immediately returns.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no open members.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - all the members are full.
+ *     - CORO_BUS_ERR_NO_BUDGET - the bus budget is used up.
+ */
+int
+coro_bus_dispatcher_try_send(struct coro_bus_dispatcher *d, unsigned data);
+
+/**
+ * Make a pipeline of channels sharing a budget of messages in
+ * flight. Each message sent to the head channel takes a credit,
+ * and gets it back when it is received or dropped from the tail
+ * channel, or when it expires in the head. When there are no
+ * credits, the head is considered full even if it has space, so
+ * the senders block. The stages between the head and the tail are
+ * not known to the pipeline. A stage which doesn't forward a
+ * message, or loses it to a TTL or an overflow (see the channel
+ * stat), must release its credit with coro_bus_pipeline_release().
+ * The head and the tail can be the
+ * same channel. The pipeline must be deleted before the bus.
+ * @param bus Bus where the channels are located.
+ * @param head Channel where the messages enter the pipeline.
+ * @param tail Channel where the messages leave the pipeline.
+ * @param credits Max number of messages in flight.
+ *
+ * @retval not NULL The pipeline.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - a channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the head is lossy, or a
+ *       channel already is a head or a tail of another pipeline.
+ */
+struct coro_bus_pipeline *
+coro_bus_pipeline_new(struct coro_bus *bus, int head, int tail,
+	size_t credits);
+
+/** Delete the pipeline. The channels stay open. */
+void
+coro_bus_pipeline_delete(struct coro_bus_pipeline *p);
+
+/** Number of messages which took credits and didn't return them. */
+size_t
+coro_bus_pipeline_in_flight(const struct coro_bus_pipeline *p);
+
+/** Return credits of the messages dropped inside the pipeline. */
+void
+coro_bus_pipeline_release(struct coro_bus_pipeline *p, size_t count);
+
+/**
+ * Link one channel to another. Messages sent to the source go
+ * through the function right in the send path and the forwarded
+ * ones are pushed to the destination. So the source has the space
+ * and the backpressure of the destination, and no coroutine is
+ * needed per stage. Links can be chained. Messages pending in the
+ * source before linking stay there. Relinking replaces the old
+ * link. Atomic batch sends to a linked channel are not supported.
+ * If the destination is closed, the link is removed.
+ * @param bus Bus where the channels are located.
+ * @param src Channel to link.
+ * @param dst Channel to forward the messages to.
+ * @param func Transform and filter of the messages.
+ * @param ctx Argument for the function.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - a channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the link makes a cycle.
+ */
+int
+coro_bus_link(struct coro_bus *bus, int src, int dst, coro_bus_link_f func,
+	void *ctx);
+
+/**
+ * Remove the link of the channel if any. New messages stay in the
+ * channel again.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_unlink(struct coro_bus *bus, int src);
+
+/**
+ * Make the channel batch the single message sends. The messages
+ * are held back, invisible to the receivers, and pushed all at
+ * once with a single wakeup when there are max_count of them or
+ * max_delay_usec passes since the first one. They take space in
+ * the channel while held back. Any other kind of send flushes the
+ * batch first, so the order is kept. The time is checked on sends
+ * and receives, and the receivers waiting for a batch sleep until
+ * it is due.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param max_count Batch size to flush at. 0 or 1 disables
+ *     batching.
+ * @param max_delay_usec Max time a message is held back. 0 means
+ *     no limit, only the size or coro_bus_flush() flush it.
+ *
+ * @retval 0 Success. The pending batch is flushed.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - it is a conflating or a
+ *       priority channel.
+ */
+int
+coro_bus_channel_set_batch(struct coro_bus *bus, int channel,
+	size_t max_count, uint64_t max_delay_usec);
+
+/**
+ * Push the held back messages of the channel right now.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_flush(struct coro_bus *bus, int channel);
+
+/**
+ * Defer the receiver wakeups on the bus. Sends only mark the
+ * channels, and their receivers are woken up once, when the
+ * sending coroutine suspends, yields, or finishes. So a burst of
+ * sends costs one wakeup per receiver instead of one per message.
+ * Turning it off wakes up the marked receivers right away. The
+ * coroutine switch hook stays installed while any bus defers the
+ * wakeups, deleting the bus turns them off.
+ */
+void
+coro_bus_set_deferred_wakeups(struct coro_bus *bus, bool is_deferred);
+
+/**
+ * Aggregate the messages sent to the channel in windows. The
+ * messages are reduced as they arrive and not stored. Only one
+ * summary per window gets into the channel. The time of a window
+ * is checked on sends and receives, and the receivers waiting for
+ * a window by time sleep until it ends.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param opts Window settings. NULL removes the window.
+ *
+ * @retval 0 Success. The summary of the old tumbling window, if
+ *     started, is pushed to the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - bad settings, or it is a
+ *       conflating or a priority channel.
+ */
+int
+coro_bus_channel_set_window(struct coro_bus *bus, int channel,
+	const struct coro_bus_window_opts *opts);
+
+/**
+ * Limit the rate at which the receivers can take messages from
+ * the channel with a token bucket. Each message takes a token,
+ * and the tokens are refilled at the given rate up to the burst.
+ * Receivers finding messages but no tokens sleep until the next
+ * token is refilled. The bucket starts full. Draining the channel
+ * with coro_bus_drain_swap() is not possible while it is limited.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param rate Messages per second. 0 removes the limit.
+ * @param burst Maximal number of tokens. 0 means 1.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the burst is too big.
+ */
+int
+coro_bus_channel_set_rate(struct coro_bus *bus, int channel, uint64_t rate,
+	uint64_t burst);
+
+/**
+ * Drop the messages sent to the channel with a key seen among
+ * the last keys accepted by it. Messages sent without a key are
+ * their own keys. The duplicates are dropped at sending, so they
+ * never take space, and sending a duplicate never blocks. The
+ * messages sent with a vector can still wait for the space of
+ * the whole vector.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param size How many last different keys to remember. 0 turns
+ *     the filter off.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_set_dedup(struct coro_bus *bus, int channel, size_t size);
+
+/**
+ * Limit the number of messages held by all the channels of the
+ * bus together: queued, held back in batches, and in flight in
+ * the ack mode. Sends beyond the budget wait until it is freed,
+ * and the non-blocking sends fail with CORO_BUS_ERR_NO_BUDGET.
+ * Lossy channels drop the messages which don't fit. The budget
+ * can be set below the current usage, then the new messages are
+ * not accepted until enough of the old ones are consumed.
+ * @param bus Bus to limit.
+ * @param budget Maximal number of messages. 0 means no limit.
+ */
+void
+coro_bus_set_budget(struct coro_bus *bus, size_t budget);
+
+/**
+ * Get the number of messages held by all the channels of the bus,
+ * as counted against the budget.
+ */
+size_t
+coro_bus_usage(struct coro_bus *bus);
+
+/**
+ * Create a reader merging several sorted channels into one sorted
+ * stream. Each message is its own ordering value, like a sequence
+ * number or a timestamp. The next message is known only when each
+ * open input has a message, so the merge waits for all of them.
+ * The inputs are read in batches and the taken messages are kept
+ * by the merge. Closed inputs are skipped. The merge must be
+ * deleted before the bus.
+ * @param bus Bus where the channels are located.
+ * @param channels Descriptors of the input channels.
+ * @param count Number of the inputs.
+ */
+struct coro_bus_merge *
+coro_bus_merge_new(struct coro_bus *bus, const int *channels, size_t count);
+
+/** Delete the merge. The messages buffered in it are lost. */
+void
+coro_bus_merge_delete(struct coro_bus_merge *m);
+
+/**
+ * Get the smallest message among the heads of all the inputs. If
+ * some open input is empty, the function suspends the current
+ * coroutine until it gets data or is closed.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - all the inputs are closed and
+ *       the merge is empty.
+ */
+int
+coro_bus_merge_next(struct coro_bus_merge *m, unsigned *data);
+
+/**
+ * Same as coro_bus_merge_next(), but if some open input is empty,
+ * the function immediately returns.
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - all the inputs are closed and
+ *       the merge is empty.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - an open input is empty.
+ */
+int
+coro_bus_merge_try_next(struct coro_bus_merge *m, unsigned *data);
+
+/**
+ * Create a one-shot future: a value which is set once and can be
+ * awaited by any number of coroutines. Deleted futures are kept
+ * by the bus for reuse, so they are cheap to create. They must
+ * be deleted before the bus.
+ */
+struct coro_future *
+coro_bus_future_new(struct coro_bus *bus);
+
+/** Return the future to the pool. Nobody must be awaiting it. */
+void
+coro_future_delete(struct coro_future *f);
+
+/**
+ * Set the value and wake up all the waiters.
+ * @retval 0 Success.
+ * @retval -1 The value is already set. It is not changed.
+ */
+int
+coro_future_set(struct coro_future *f, unsigned value);
+
+/** Check if the value is set already. */
+bool
+coro_future_is_set(const struct coro_future *f);
+
+/**
+ * Get the value. If it is not set yet, suspend the current
+ * coroutine until it is.
+ */
+unsigned
+coro_future_await(struct coro_future *f);
+
+/**
+ * Wait until any of the futures is set.
+ * @retval >=0 Index of the first set future in the array.
+ * @retval -1 The array is empty.
+ */
+int
+coro_future_await_any(struct coro_future **futures, size_t count);
+
+/** Wait until all the futures are set. */
+void
+coro_future_await_all(struct coro_future **futures, size_t count);
+
+#if NEED_BATCH /* RPC is built on the batch sends. */
+
+/**
+ * Send a request to a service channel and wait for the reply. The
+ * request goes into the channel as two messages sent atomically:
+ * the correlation ID and the request itself. The service takes
+ * them with coro_bus_recv_request() and answers with
+ * coro_bus_reply(). The reply is delivered into a pooled one-shot
+ * slot, so no channel is opened per call. The service channel
+ * must not be lossy, conflating, matching, acked, deduplicating,
+ * batched, windowed, rate-limited, linked or have messages with
+ * a TTL, not to break or lose the pairs. If the channel is closed or the bus is deleted after the
+ * request is queued, the call fails.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the service channel.
+ * @param request Request to send.
+ * @param reply Output parameter to save the reply to.
+ * @param timeout_usec How long to wait for sending and for the
+ *     reply. 0 means forever.
+ *
+ * @retval 0 Success. Reply output is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist, or
+ *       it was closed or the bus was deleted before the reply.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - too many calls in progress.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel can't be a
+ *       service channel.
+ *     - CORO_BUS_ERR_TIMEOUT - no reply in time. A late reply
+ *       is dropped.
+ */
+int
+coro_bus_call(struct coro_bus *bus, int channel, unsigned request,
+	unsigned *reply, uint64_t timeout_usec);
+
+/**
+ * Receive a request sent by coro_bus_call(). If the channel is
+ * empty, the function suspends the current coroutine.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the service channel.
+ * @param id Output parameter to save the correlation ID to.
+ * @param request Output parameter to save the request to.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel can't be a
+ *       service channel.
+ */
+int
+coro_bus_recv_request(struct coro_bus *bus, int channel, unsigned *id,
+	unsigned *request);
+
+/**
+ * Same as coro_bus_recv_request(), but if the channel is empty,
+ * the function immediately returns.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel can't be a
+ *       service channel.
+ */
+int
+coro_bus_try_recv_request(struct coro_bus *bus, int channel, unsigned *id,
+	unsigned *request);
+
+/**
+ * Answer a request. It never blocks.
+ * @param bus Bus where the call was made.
+ * @param id Correlation ID of the request.
+ * @param reply Reply to deliver to the caller.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the caller is not waiting
+ *       anymore, it has timed out or got a reply already.
+ */
+int
+coro_bus_reply(struct coro_bus *bus, unsigned id, unsigned reply);
+
+#endif /* NEED_BATCH */
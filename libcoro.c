@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -50,6 +51,10 @@ struct coro {
 	struct coro *joiner;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** When to wake up the suspended coroutine by itself. */
+	uint64_t deadline;
+	/** Link in the list of the coroutines having a deadline. */
+	struct rlist in_sleepers;
 };
 
 struct coro_engine {
@@ -74,8 +79,12 @@ struct coro_engine {
 	struct rlist coros_running_next;
 	/** Joined coroutines to be reused. */
 	struct rlist coros_pool;
+	/** Suspended coroutines with deadlines, the nearest first. */
+	struct rlist sleepers;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/** Called each time before a switch to another coroutine. */
+	coro_switch_hook_f switch_hook;
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
@@ -89,14 +98,22 @@ coro_engine_create(struct coro_engine *engine)
 {
 	memset(engine, 0, sizeof(*engine));
 	rlist_create(&engine->sched.link);
+	rlist_create(&engine->sched.in_sleepers);
 	rlist_create(&engine->coros_running_now);
 	rlist_create(&engine->coros_running_next);
 	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->sleepers);
 }
 
 static void
 coro_engine_resume_next(struct coro_engine *engine)
 {
+	/*
+	 * The hook can wake up coroutines. They are added to the next
+	 * iteration, so the current one is not affected.
+	 */
+	if (engine->switch_hook != NULL)
+		engine->switch_hook();
 	assert(!rlist_empty(&engine->coros_running_now));
 	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
 		struct coro, link);
@@ -126,6 +143,26 @@ coro_engine_suspend(struct coro_engine *engine)
 	coro_engine_resume_next(engine);
 }
 
+static void
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline)
+{
+	struct coro *this = engine->this;
+	if (this == NULL || deadline == UINT64_MAX) {
+		coro_engine_suspend(engine);
+		return;
+	}
+	this->deadline = deadline;
+	/* The new deadlines are usually the latest, look from the end. */
+	struct rlist *pos;
+	rlist_foreach_reverse(pos, &engine->sleepers) {
+		struct coro *c = rlist_entry(pos, struct coro, in_sleepers);
+		if (c->deadline <= deadline)
+			break;
+	}
+	rlist_add(pos, &this->in_sleepers);
+	coro_engine_suspend(engine);
+}
+
 static void
 coro_engine_yield(struct coro_engine *engine)
 {
@@ -145,15 +182,54 @@ coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 		return;
 	assert(coro->state == CORO_STATE_SUSPENDED);
 	assert(rlist_empty(&coro->link));
+	rlist_del(&coro->in_sleepers);
 	coro->state = CORO_STATE_RUNNING;
 	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
 }
 
+uint64_t
+coro_time_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wake up the coroutines whose deadlines have come. If nothing
+ * else can run, sleep until the nearest deadline first.
+ */
+static void
+coro_engine_wakeup_sleepers(struct coro_engine *engine)
+{
+	if (rlist_empty(&engine->sleepers))
+		return;
+	struct coro *c = rlist_first_entry(&engine->sleepers, struct coro,
+		in_sleepers);
+	if (rlist_empty(&engine->coros_running_next)) {
+		struct timespec ts;
+		ts.tv_sec = c->deadline / 1000000;
+		ts.tv_nsec = c->deadline % 1000000 * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			NULL) == EINTR)
+			;
+	}
+	uint64_t now = coro_time_usec();
+	while (!rlist_empty(&engine->sleepers)) {
+		c = rlist_first_entry(&engine->sleepers, struct coro,
+			in_sleepers);
+		if (c->deadline > now)
+			break;
+		coro_engine_wakeup(engine, c);
+	}
+}
+
 static void
 coro_engine_run(struct coro_engine *engine)
 {
 	while (true) {
 		assert(rlist_empty(&engine->coros_running_now));
+		coro_engine_wakeup_sleepers(engine);
 		rlist_splice_tail(&engine->coros_running_now,
 			&engine->coros_running_next);
 		if (rlist_empty(&engine->coros_running_now))
@@ -203,9 +279,21 @@ static __thread struct coro_engine *new_coro_engine = NULL;
  * constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_body(int signum, siginfo_t *info, void *context)
 {
 	(void)signum;
+	(void)info;
+	/*
+	 * The handler never returns, but its signal frame stays on top
+	 * of the coroutine stack. The context saved there points into
+	 * the constructor's stack as it was at this moment, which is
+	 * reused right away, and by a pooled coroutine long after. A
+	 * stack unwinder, like backtrace() called by the coroutine,
+	 * walks through the frame into that garbage. The context is
+	 * never restored, so it is wiped to end the unwinding here.
+	 */
+	ucontext_t *uc = context;
+	memset(&uc->uc_mcontext, 0, sizeof(uc->uc_mcontext));
 	struct coro_engine *my_engine = new_coro_engine;
 	new_coro_engine = NULL;
 
@@ -253,6 +341,7 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	c->func_arg = func_arg;
 	c->joiner = NULL;
 	rlist_create(&c->link);
+	rlist_create(&c->in_sleepers);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -268,8 +357,8 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
+	newsa.sa_sigaction = coro_body;
+	newsa.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
@@ -401,6 +490,12 @@ coro_suspend(void)
 	coro_engine_suspend(&glob_engine);
 }
 
+void
+coro_suspend_until(uint64_t deadline)
+{
+	coro_engine_suspend_until(&glob_engine, deadline);
+}
+
 void
 coro_yield(void)
 {
@@ -412,3 +507,9 @@ coro_wakeup(struct coro *coro)
 {
 	coro_engine_wakeup(&glob_engine, coro);
 }
+
+void
+coro_set_switch_hook(coro_switch_hook_f hook)
+{
+	glob_engine.switch_hook = hook;
+}
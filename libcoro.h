@@ -1,9 +1,11 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
+typedef void (*coro_switch_hook_f)(void);
 
 /** Initialize the coroutines engine. */
 void
@@ -54,6 +56,19 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/** Current time in microseconds by the monotonic clock. */
+uint64_t
+coro_time_usec(void);
+
+/**
+ * Same as coro_suspend(), but the coroutine is also woken up by
+ * itself when coro_time_usec() reaches the deadline. If nothing
+ * else can run, the scheduler sleeps until the nearest deadline.
+ * UINT64_MAX means no deadline.
+ */
+void
+coro_suspend_until(uint64_t deadline);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -69,3 +84,12 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Set a function to be called each time the current coroutine
+ * is about to give the control away: when it suspends, yields,
+ * or finishes. NULL removes the hook. The hook may wake up
+ * coroutines, but must not switch itself.
+ */
+void
+coro_set_switch_hook(coro_switch_hook_f hook);
@@ -4,6 +4,8 @@
 #include "corobus.h"
 
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -101,6 +103,17 @@ recv_join(struct ctx_recv *ctx)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/** CPU time of the process, to see the waits don't spin. */
+static uint64_t
+cpu_time_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_basic(void)
 {
@@ -255,6 +268,116 @@ test_multiple_channels(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_channel_stat(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stat st;
+
+	unit_msg("channel never existed");
+	unit_assert(coro_bus_channel_stat(bus, 0, &st) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("empty channel");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.size_limit == 2);
+	unit_assert(st.send_waiters == 0 && st.recv_waiters == 0);
+	unit_assert(st.high_watermark == 0);
+
+	unit_msg("waiting receivers");
+	unsigned data1 = 0, data2 = 0;
+	struct ctx_recv ctx_r1, ctx_r2;
+	recv_start(&ctx_r1, bus, c1, &data1);
+	recv_start(&ctx_r2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.send_waiters == 0 && st.recv_waiters == 2);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(recv_join(&ctx_r1) == 0 && data1 == 1);
+	unit_assert(recv_join(&ctx_r2) == 0 && data2 == 2);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.recv_waiters == 0);
+	unit_assert(st.high_watermark == 2);
+
+	unit_msg("waiting sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	struct ctx_send ctx_s;
+	send_start(&ctx_s, bus, c1, 3);
+	coro_yield();
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 2 && st.send_waiters == 1);
+	unit_assert(st.recv_waiters == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0 && data1 == 1);
+	unit_assert(send_join(&ctx_s) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 2 && st.send_waiters == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_set_limit(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("channel never existed");
+	unit_assert(coro_bus_channel_set_limit(bus, 0, 10) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("fill the channel and block the senders");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	const unsigned coro_count = 4;
+	struct ctx_send ctx[coro_count];
+	for (unsigned i = 0; i < coro_count; ++i)
+		send_start(&ctx[i], bus, c1, i + 1);
+	coro_yield();
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(ctx[i].is_started && !ctx[i].is_done);
+
+	unit_msg("grow the limit, some senders fit");
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 4) == 0);
+	coro_yield();
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(send_join(&ctx[i]) == 0);
+	unit_assert(!ctx[3].is_done);
+	struct coro_bus_channel_stat st;
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 4 && st.size_limit == 4);
+	unit_assert(st.send_waiters == 1);
+
+	unit_msg("shrink the limit, the messages are kept");
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 2) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	coro_yield();
+	unit_assert(!ctx[3].is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(send_join(&ctx[3]) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_basic(void)
 {
@@ -1316,6 +1439,141 @@ test_send_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_send_vector_atomic_basic(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("channel never existed");
+	unsigned data3[3] = {1, 2, 3};
+	unit_assert(coro_bus_send_v_atomic(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_send_v_atomic(bus, 0, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("batch doesn't fit, nothing is sent");
+	int c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_try_send_v_atomic(bus, c1, data3, 3) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 123;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("batch fits");
+	unit_assert(coro_bus_try_send_v_atomic(bus, c1, data3, 3) == 3);
+	unit_assert(coro_bus_send_v_atomic(bus, c1, data3, 1) == 1);
+	for (unsigned i = 1; i <= 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+
+	unit_msg("batch is bigger than the channel");
+	unsigned data5[5] = {1, 2, 3, 4, 5};
+	unit_assert(coro_bus_send_v_atomic(bus, c1, data5, 5) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if NEED_BATCH
+static void *
+send_v_atomic_f(void *arg)
+{
+	struct ctx_send_v *ctx = arg;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_send_v_atomic(ctx->bus, ctx->channel, ctx->data,
+		ctx->count);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+send_v_atomic_start(struct ctx_send_v *ctx, struct coro_bus *bus,
+	int channel, const unsigned *data, unsigned count)
+{
+	ctx->bus = bus;
+	ctx->channel = channel;
+	ctx->data = data;
+	ctx->count = count;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_started = false;
+	ctx->is_done = false;
+	ctx->worker = coro_new(send_v_atomic_f, ctx);
+}
+#endif
+
+static void
+test_send_vector_atomic_blocking(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0);
+
+	unit_msg("fill the channel");
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+
+	unit_msg("start an atomic sender and then a normal one");
+	unsigned data3[3] = {10, 11, 12};
+	struct ctx_send_v ctx_v;
+	send_v_atomic_start(&ctx_v, bus, c1, data3, 3);
+	coro_yield();
+	unit_assert(ctx_v.is_started && !ctx_v.is_done);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 100);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+
+	unit_msg("the freed space is reserved for the batch");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	coro_yield();
+	unit_assert(!ctx.is_done && !ctx_v.is_done);
+	unit_assert(coro_bus_try_send(bus, c1, 200) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(send_v_join(&ctx_v) == 3);
+
+	unit_msg("the batch is contiguous");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == data3[i]);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 100);
+
+	unit_msg("close wakes up the atomic sender");
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	send_v_atomic_start(&ctx_v, bus, c1, data3, 3);
+	coro_yield();
+	unit_assert(ctx_v.is_started && !ctx_v.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(send_v_join(&ctx_v) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_recv_vector_basic(void)
 {
@@ -1603,6 +1861,2274 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_drain_swap(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_buffer buf = {NULL, 0, 0};
+
+	unit_msg("channel never existed");
+	unit_assert(coro_bus_drain_swap(bus, 0, &buf) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("channel is empty");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(buf.data == NULL && buf.size == 0);
+
+	unit_msg("fill the channel and block a sender");
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+
+	unit_msg("drain wakes up the sender");
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) == 3);
+	unit_assert(buf.size == 3 && buf.capacity >= 3);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(buf.data[i] == i);
+	unit_assert(send_join(&ctx) == 0);
+
+	unit_msg("the empty buffer becomes the channel storage");
+	unsigned *old = buf.data;
+	buf.size = 0;
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) == 1);
+	unit_assert(buf.size == 1 && buf.data[0] == 3);
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	buf.size = 0;
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) == 1);
+	unit_assert(buf.data == old && buf.data[0] == 4);
+
+	unit_msg("the buffer must be empty");
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(buf.size == 1 && buf.data[0] == 4);
+	free(buf.data);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_adaptive_limit(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+
+	unit_msg("channel never existed");
+	unit_assert(coro_bus_channel_set_adaptive(bus, c1 + 1, 2, 32) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("bad bounds");
+	unit_assert(coro_bus_channel_set_adaptive(bus, c1, 32, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+
+	unit_msg("the limit is clamped into the bounds");
+	struct coro_bus_channel_stat st;
+	unit_assert(coro_bus_channel_set_adaptive(bus, c1, 4, 32) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size_limit == 4);
+
+	unit_msg("a producer which blocks all the time makes it grow");
+	const unsigned count = 1000;
+	unsigned *data = calloc(count, sizeof(*data));
+	for (unsigned i = 0; i < count; ++i)
+		data[i] = i;
+	struct ctx_send_v ctx;
+	send_v_all_start(&ctx, bus, c1, data, count);
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned res = 0;
+		unit_assert(coro_bus_recv(bus, c1, &res) == 0 && res == i);
+		coro_yield();
+	}
+	unit_assert(send_v_join(&ctx) == (int)count);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size_limit == 32);
+	unit_assert(st.send_blocks > 0);
+	free(data);
+
+	unit_msg("a channel which is never full makes it shrink");
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned res = 0;
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+		unit_assert(coro_bus_recv(bus, c1, &res) == 0 && res == i);
+	}
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size_limit == 4);
+
+	unit_msg("turn it off");
+	unit_assert(coro_bus_channel_set_adaptive(bus, c1, 0, 0) == 0);
+	unit_assert(coro_bus_channel_set_limit(bus, c1, 100) == 0);
+	for (unsigned i = 0; i < count; ++i) {
+		unsigned res = 0;
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+		unit_assert(coro_bus_recv(bus, c1, &res) == 0 && res == i);
+	}
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size_limit == 100);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_overflow(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 3;
+	struct coro_bus_channel_stat st;
+	unsigned data = 0;
+
+	unit_msg("drop newest");
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_NEWEST;
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 3 && st.dropped == 3);
+	for (unsigned i = 1; i <= 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+#if NEED_BATCH
+	unsigned data4[4] = {1, 2, 3, 4};
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send_v(bus, c1, data4, 4) == 4);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_msg("atomic batch is dropped as a whole");
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send_v_atomic(bus, c1, data4, 3) == 3);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+#endif
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("drop oldest");
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_OLDEST;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 3 && st.dropped == 2);
+	for (unsigned i = 3; i <= 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+#if NEED_BATCH
+	unsigned data5[5] = {1, 2, 3, 4, 5};
+	unit_assert(coro_bus_send(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send_v(bus, c1, data5, 5) == 5);
+	for (unsigned i = 3; i <= 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.dropped == 5);
+	unit_assert(st.high_watermark == 3);
+#endif
+	coro_bus_channel_close(bus, c1);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast doesn't wait for lossy channels");
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 5);
+	unit_assert(c2 >= 0);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_try_broadcast(bus, i) == 0);
+	unit_assert(coro_bus_try_broadcast(bus, 6) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c1);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_conflating(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 2;
+	opts.is_conflating = true;
+	struct coro_bus_channel_stat st;
+	unsigned key = 0, data = 0;
+
+	unit_msg("keys are required only for keeping them");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 10) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 11) == 0);
+	unit_assert(coro_bus_try_recv_keyed(bus, c1, &key, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 10);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 11);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("same key replaces the pending message");
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 10) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 2, 20) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 11) == 0);
+	unit_assert(coro_bus_try_send_keyed(bus, c1, 3, 30) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_keyed(bus, c1, 2, 21) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 2 && st.conflated == 2);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 1 && data == 11);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 2 && data == 21);
+	unit_assert(coro_bus_try_recv_keyed(bus, c1, &key, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("consumed key is not conflated anymore");
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 12) == 0);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 1 && data == 12);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 5 && data == 5);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("many keys");
+	opts.size_limit = 100;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned round = 0; round < 5; ++round) {
+		for (unsigned i = 0; i < 100; ++i)
+			unit_assert(coro_bus_try_send_keyed(bus, c1, i * 7919, round) == 0);
+	}
+	for (unsigned i = 0; i < 50; ++i) {
+		unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+		unit_assert(key == i * 7919 && data == 4);
+	}
+	for (unsigned i = 0; i < 100; ++i)
+		unit_assert(coro_bus_try_send_keyed(bus, c1, i * 7919, 5) == 0);
+	for (unsigned i = 50; i < 150; ++i) {
+		unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+		unit_assert(key == (i % 100) * 7919);
+		unit_assert(data == 5);
+	}
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("conflating ring");
+	opts.size_limit = 2;
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_OLDEST;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 10; ++i)
+		unit_assert(coro_bus_try_send_keyed(bus, c1, i, i) == 0);
+	unit_assert(coro_bus_try_send_keyed(bus, c1, 8, 80) == 0);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 8 && data == 80);
+	unit_assert(coro_bus_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 9 && data == 9);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.dropped == 8 && st.conflated == 1);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_priority(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 20;
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	opts.prio_levels = CORO_BUS_PRIO_MAX + 1;
+	unit_assert(coro_bus_channel_open_opts(bus, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.prio_levels = 2;
+	opts.is_conflating = true;
+	unit_assert(coro_bus_channel_open_opts(bus, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.is_conflating = false;
+
+	unit_msg("strict priority");
+	opts.prio_levels = 3;
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 1, 50) == 0);
+	unit_assert(coro_bus_try_send_prio(bus, c1, 0, 100) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 0, 101) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 100);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 101);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 50);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+#if NEED_BATCH
+	struct coro_bus_buffer buf = {NULL, 0, 0};
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+#endif
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("the size limit is shared by the levels");
+	opts.size_limit = 2;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 2, 1) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 0, 2) == 0);
+	unit_assert(coro_bus_try_send_prio(bus, c1, 0, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("weighted priority");
+	opts.size_limit = 20;
+	opts.prio_levels = 2;
+	opts.is_prio_weighted = true;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 6; ++i) {
+		unit_assert(coro_bus_send_prio(bus, c1, 1, 0) == 0);
+		unit_assert(coro_bus_send_prio(bus, c1, 0, 1) == 0);
+	}
+	const unsigned expected[12] = {1, 1, 0, 1, 1, 0, 1, 1, 0, 0, 0, 0};
+	for (unsigned i = 0; i < 12; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == expected[i]);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_ttl(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 3;
+	struct coro_bus_channel_stat st;
+	unsigned data = 0;
+
+	unit_msg("no ttl in priority channels");
+	opts.prio_levels = 2;
+	opts.ttl_usec = 1000;
+	unit_assert(coro_bus_channel_open_opts(bus, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.ttl_usec = 0;
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_send_ttl(bus, c1, 1, 1000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c1);
+	opts.prio_levels = 0;
+
+	unit_msg("default ttl");
+	opts.ttl_usec = 20000;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	usleep(30000);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 1);
+	coro_bus_channel_close(bus, c1);
+	opts.ttl_usec = 0;
+
+	unit_msg("per message ttl");
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 10000) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 3, 10000000) == 0);
+	usleep(20000);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 1);
+
+	unit_msg("full channel is swept");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 10000) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	usleep(20000);
+	unit_assert(coro_bus_try_send(bus, c1, 4) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 3 && st.expired == 2);
+	for (unsigned i = 1; i <= 4; ++i) {
+		if (i == 2)
+			continue;
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	}
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("conflating channel");
+	opts.is_conflating = true;
+	opts.size_limit = 2;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 1, 10000) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	usleep(20000);
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 1 && st.conflated == 1);
+	coro_bus_channel_close(bus, c1);
+	opts.is_conflating = false;
+	opts.size_limit = 3;
+
+	unit_msg("expired messages behind a live head are skipped");
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 10000) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	usleep(20000);
+	struct coro_bus_merge *m = coro_bus_merge_new(bus, &c1, 1);
+	unit_assert(m != NULL);
+	unit_assert(coro_bus_merge_try_next(m, &data) == 0 && data == 1);
+	unit_assert(coro_bus_merge_try_next(m, &data) == 0 && data == 3);
+	coro_bus_merge_delete(m);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 1);
+#if NEED_BATCH
+	unsigned out[3];
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 10000) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	usleep(20000);
+	unit_assert(coro_bus_try_recv_v(bus, c1, out, 3) == 2);
+	unit_assert(out[0] == 1 && out[1] == 3);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 2);
+
+	struct coro_bus_buffer buf = {NULL, 0, 0};
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 10000) == 0);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	usleep(20000);
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) == 2);
+	unit_assert(buf.size == 2 && buf.data[0] == 1 && buf.data[1] == 3);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.expired == 3);
+	free(buf.data);
+#endif
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_send_at(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stat st;
+	unsigned data = 0;
+
+	unit_msg("past time is delivered right away");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	uint64_t now = coro_bus_time_usec();
+	unit_assert(coro_bus_send_at(bus, c1, 1, now) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_send_at(bus, c1 + 1, 1, now) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("delivery in order of time");
+	now = coro_bus_time_usec();
+	unit_assert(coro_bus_send_at(bus, c1, 3, now + 80000) == 0);
+	unit_assert(coro_bus_send_at(bus, c1, 2, now + 10000) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.delayed == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_time_usec() >= now + 10000);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_time_usec() >= now + 80000);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.delayed == 0);
+
+	unit_msg("due message waits for space");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send_at(bus, c1, 3, coro_bus_time_usec()) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 2 && st.delayed == 1);
+	for (unsigned i = 1; i <= 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+
+	unit_msg("receiver sleeps until an earlier message");
+	struct ctx_recv ctx;
+	now = coro_bus_time_usec();
+	unit_assert(coro_bus_send_at(bus, c1, 5, now + 3600000000ull) == 0);
+	recv_start(&ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	uint64_t cpu = cpu_time_usec();
+	unit_assert(coro_bus_send_at(bus, c1, 4, now + 20000) == 0);
+	unit_assert(recv_join(&ctx) == 0 && data == 4);
+	uint64_t passed = coro_bus_time_usec() - now;
+	unit_assert(passed >= 20000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+
+	unit_msg("close drops the scheduled messages");
+	now = coro_bus_time_usec();
+	unit_assert(coro_bus_send_at(bus, c1, 1, now + 3600000000ull) == 0);
+	unit_assert(coro_bus_send_at(bus, c1, 2, now + 1000000) == 0);
+	unit_assert(coro_bus_send_at(bus, c1, 3, now) == 0);
+	coro_bus_channel_close(bus, c1);
+	c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.delayed == 0);
+	unit_assert(coro_bus_send_at(bus, c1, 4, now + 3600000000ull) == 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_partition(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_partition *p = coro_bus_partition_new(bus);
+	const unsigned key_count = 1000;
+	int owners[1000];
+	int chans[5];
+	unsigned key = 0, data = 0;
+
+	unit_msg("no members");
+	unit_assert(coro_bus_partition_route(p, 1) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_partition_try_send_keyed(p, 1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_partition_add(p, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("keys are spread and keep order");
+	for (int i = 0; i < 5; ++i) {
+		chans[i] = coro_bus_channel_open(bus, 2 * key_count);
+		unit_assert(chans[i] >= 0);
+	}
+	for (int i = 0; i < 4; ++i)
+		unit_assert(coro_bus_partition_add(p, chans[i]) == 0);
+	unit_assert(coro_bus_partition_add(p, chans[0]) == 0);
+	for (unsigned k = 0; k < key_count; ++k) {
+		owners[k] = coro_bus_partition_route(p, k);
+		unit_assert(owners[k] >= 0 && owners[k] != chans[4]);
+		unit_assert(coro_bus_partition_try_send_keyed(p, k, 0) == 0);
+		unit_assert(coro_bus_partition_send_keyed(p, k, 1) == 0);
+	}
+	for (int i = 0; i < 4; ++i) {
+		unsigned count = 0;
+		unsigned expected = 0;
+		while (coro_bus_try_recv(bus, chans[i], &data) == 0) {
+			unit_assert(data == expected);
+			expected = 1 - expected;
+			++count;
+		}
+		/* Every member gets a fair share. */
+		unit_assert(count > key_count / 4 && count < key_count);
+	}
+	for (unsigned k = 0; k < key_count; ++k)
+		unit_assert(coro_bus_partition_route(p, k) == owners[k]);
+
+	unit_msg("removal moves only the keys of the removed member");
+	unit_assert(coro_bus_partition_remove(p, chans[1]) == 0);
+	unit_assert(coro_bus_partition_remove(p, chans[1]) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	for (unsigned k = 0; k < key_count; ++k) {
+		int ch = coro_bus_partition_route(p, k);
+		unit_assert(ch != chans[1]);
+		if (owners[k] != chans[1])
+			unit_assert(ch == owners[k]);
+		owners[k] = ch;
+	}
+
+	unit_msg("addition moves keys only to the new member");
+	unit_assert(coro_bus_partition_add(p, chans[4]) == 0);
+	unsigned moved = 0;
+	for (unsigned k = 0; k < key_count; ++k) {
+		int ch = coro_bus_partition_route(p, k);
+		if (ch != owners[k]) {
+			unit_assert(ch == chans[4]);
+			++moved;
+		}
+	}
+	unit_assert(moved > 0 && moved < key_count / 2);
+
+	unit_msg("conflating members");
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	opts.is_conflating = true;
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	struct coro_bus_partition *p2 = coro_bus_partition_new(bus);
+	unit_assert(coro_bus_partition_add(p2, c1) == 0);
+	unit_assert(coro_bus_partition_send_keyed(p2, 7, 1) == 0);
+	unit_assert(coro_bus_partition_send_keyed(p2, 7, 2) == 0);
+	unit_assert(coro_bus_try_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 7 && data == 2);
+	coro_bus_partition_delete(p2);
+
+	coro_bus_partition_delete(p);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_dispatch {
+	struct coro_bus_dispatcher *d;
+	unsigned data;
+	int rc;
+	bool is_done;
+};
+
+static void *
+dispatch_f(void *arg)
+{
+	struct ctx_dispatch *ctx = arg;
+	ctx->rc = coro_bus_dispatcher_send(ctx->d, ctx->data);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_dispatcher(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_dispatcher *d = coro_bus_dispatcher_new(bus);
+	struct coro_bus_channel_stat st;
+	unsigned data = 0;
+
+	unit_msg("no members");
+	unit_assert(coro_bus_dispatcher_try_send(d, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_dispatcher_send(d, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("even spread");
+	int c1 = coro_bus_channel_open(bus, 4);
+	int c2 = coro_bus_channel_open(bus, 4);
+	int c3 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0 && c2 >= 0 && c3 >= 0);
+	unit_assert(coro_bus_dispatcher_add(d, c1) == 0);
+	unit_assert(coro_bus_dispatcher_add(d, c2) == 0);
+	unit_assert(coro_bus_dispatcher_add(d, c2) == 0);
+	unit_assert(coro_bus_dispatcher_add(d, c3) == 0);
+	for (unsigned i = 0; i < 6; ++i)
+		unit_assert(coro_bus_dispatcher_send(d, i) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0 && st.size == 2);
+	unit_assert(coro_bus_channel_stat(bus, c2, &st) == 0 && st.size == 2);
+	unit_assert(coro_bus_channel_stat(bus, c3, &st) == 0 && st.size == 2);
+
+	unit_msg("the least loaded member is preferred");
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0);
+	unit_assert(coro_bus_dispatcher_try_send(d, 10) == 0);
+	unit_assert(coro_bus_dispatcher_try_send(d, 11) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c2, &st) == 0 && st.size == 2);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 10);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 11);
+
+	unit_msg("full members are skipped");
+	unit_assert(coro_bus_dispatcher_remove(d, c2) == 0);
+	unit_assert(coro_bus_dispatcher_remove(d, c2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_dispatcher_try_send(d, i) == 0);
+	unit_assert(coro_bus_dispatcher_try_send(d, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("blocking send waits for any member");
+	struct ctx_dispatch ctx;
+	ctx.d = d;
+	ctx.data = 100;
+	ctx.rc = -1;
+	ctx.is_done = false;
+	struct coro *worker = coro_new(dispatch_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done && ctx.rc == 0);
+	unit_assert(coro_bus_channel_stat(bus, c3, &st) == 0 && st.size == 4);
+
+	unit_msg("closed members are skipped");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_dispatcher_try_send(d, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c3);
+	unit_assert(coro_bus_dispatcher_try_send(d, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_dispatcher_delete(d);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+#if NEED_BATCH
+
+struct ctx_service {
+	struct coro_bus *bus;
+	int channel;
+	unsigned count;
+};
+
+static void *
+service_f(void *arg)
+{
+	struct ctx_service *ctx = arg;
+	unsigned id, req;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		unit_assert(coro_bus_recv_request(ctx->bus, ctx->channel, &id,
+			&req) == 0);
+		coro_yield();
+		unit_assert(coro_bus_reply(ctx->bus, id, req * 2) == 0);
+	}
+	return NULL;
+}
+
+struct ctx_call {
+	struct coro_bus *bus;
+	int channel;
+	unsigned base;
+	unsigned count;
+	uint64_t timeout;
+};
+
+static void *
+call_f(void *arg)
+{
+	struct ctx_call *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		unsigned resp = 0;
+		unit_assert(coro_bus_call(ctx->bus, ctx->channel, ctx->base + i,
+			&resp, ctx->timeout) == 0);
+		unit_assert(resp == (ctx->base + i) * 2);
+	}
+	return NULL;
+}
+
+struct ctx_lost_call {
+	struct coro_bus *bus;
+	int channel;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+lost_call_f(void *arg)
+{
+	struct ctx_lost_call *ctx = arg;
+	unsigned resp = 0;
+	ctx->rc = coro_bus_call(ctx->bus, ctx->channel, 1, &resp, 0);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_call(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned id = 0, req = 0, resp = 0;
+
+	unit_msg("no service channel");
+	unit_assert(coro_bus_call(bus, 0, 1, &resp, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("many callers");
+	int c1 = coro_bus_channel_open(bus, 4);
+	unit_assert(c1 >= 0);
+	struct ctx_service service = {bus, c1, 300};
+	struct coro *service_worker = coro_new(service_f, &service);
+	struct ctx_call calls[3];
+	struct coro *workers[3];
+	for (unsigned i = 0; i < 3; ++i) {
+		calls[i].bus = bus;
+		calls[i].channel = c1;
+		calls[i].base = i * 1000;
+		calls[i].count = 100;
+		calls[i].timeout = 0;
+		workers[i] = coro_new(call_f, &calls[i]);
+	}
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_join(workers[i]) == NULL);
+	unit_assert(coro_join(service_worker) == NULL);
+
+	unit_msg("timeout");
+	uint64_t cpu = cpu_time_usec();
+	uint64_t start = coro_bus_time_usec();
+	unit_assert(coro_bus_call(bus, c1, 5, &resp, 10000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	uint64_t passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 10000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+	unit_assert(coro_bus_try_recv_request(bus, c1, &id, &req) == 0);
+	unit_assert(req == 5);
+	unit_msg("late reply is dropped");
+	unit_assert(coro_bus_reply(bus, id, 10) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_recv_request(bus, c1, &id, &req) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("timeout on a full channel");
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	cpu = cpu_time_usec();
+	start = coro_bus_time_usec();
+	unit_assert(coro_bus_call(bus, c1, 5, &resp, 10000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 10000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+
+	unit_msg("call with a timeout waits for space");
+	struct ctx_call timed = {bus, c1, 7, 1, 1000000};
+	struct coro *timed_worker = coro_new(call_f, &timed);
+	coro_yield();
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_try_recv(bus, c1, &req) == 0 && req == i);
+	unit_assert(coro_bus_recv_request(bus, c1, &id, &req) == 0);
+	unit_assert(req == 7);
+	unit_assert(coro_bus_reply(bus, id, 14) == 0);
+	unit_assert(coro_join(timed_worker) == NULL);
+
+	unit_msg("channels splitting the pairs are refused");
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 4;
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_OLDEST;
+	int c2 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_call(bus, c2, 5, &resp, 10000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_try_recv_request(bus, c2, &id, &req) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c2);
+	c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_channel_set_rate(bus, c2, 1, 1) == 0);
+	unit_assert(coro_bus_call(bus, c2, 5, &resp, 10000) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c2);
+	opts.overflow = CORO_BUS_OVERFLOW_BLOCK;
+	opts.ttl_usec = 1000;
+	c2 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_call(bus, c2, 5, &resp, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c2);
+	c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send_ttl(bus, c2, 1, 1000000) == 0);
+	unit_assert(coro_bus_call(bus, c2, 5, &resp, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("close fails the waiting calls");
+	c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	struct ctx_lost_call lost = {bus, c2, 0, CORO_BUS_ERR_NONE, false};
+	struct coro *caller = coro_new(lost_call_f, &lost);
+	coro_yield();
+	unit_assert(!lost.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_join(caller) == NULL);
+	unit_assert(lost.rc != 0 && lost.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("delete fails the waiting calls");
+	c2 = coro_bus_channel_open(bus, 4);
+	unit_assert(c2 >= 0);
+	lost.channel = c2;
+	lost.is_done = false;
+	caller = coro_new(lost_call_f, &lost);
+	coro_yield();
+	unit_assert(!lost.is_done);
+
+	coro_bus_delete(bus);
+	unit_assert(coro_join(caller) == NULL);
+	unit_assert(lost.rc != 0 && lost.err == CORO_BUS_ERR_NO_CHANNEL);
+	unit_test_finish();
+#endif
+}
+
+struct ctx_future {
+	struct coro_future **futures;
+	size_t count;
+	int result;
+	bool is_done;
+};
+
+static void *
+future_await_f(void *arg)
+{
+	struct ctx_future *ctx = arg;
+	ctx->result = coro_future_await(ctx->futures[0]);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+future_await_any_f(void *arg)
+{
+	struct ctx_future *ctx = arg;
+	ctx->result = coro_future_await_any(ctx->futures, ctx->count);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+future_await_all_f(void *arg)
+{
+	struct ctx_future *ctx = arg;
+	coro_future_await_all(ctx->futures, ctx->count);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_future(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_future *fs[3];
+	for (int i = 0; i < 3; ++i)
+		fs[i] = coro_bus_future_new(bus);
+
+	unit_msg("set once");
+	unit_assert(!coro_future_is_set(fs[0]));
+	unit_assert(coro_future_set(fs[0], 10) == 0);
+	unit_assert(coro_future_set(fs[0], 11) != 0);
+	unit_assert(coro_future_is_set(fs[0]));
+	unit_assert(coro_future_await(fs[0]) == 10);
+
+	unit_msg("many waiters");
+	struct ctx_future ctx[3];
+	struct coro *workers[3];
+	for (int i = 0; i < 3; ++i) {
+		ctx[i].futures = &fs[1];
+		ctx[i].count = 1;
+		ctx[i].is_done = false;
+		workers[i] = coro_new(future_await_f, &ctx[i]);
+	}
+	coro_yield();
+	unit_assert(!ctx[0].is_done && !ctx[1].is_done && !ctx[2].is_done);
+	unit_assert(coro_future_set(fs[1], 20) == 0);
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(coro_join(workers[i]) == NULL);
+		unit_assert(ctx[i].is_done && ctx[i].result == 20);
+	}
+
+	unit_msg("pool reuse");
+	struct coro_future *old = fs[0];
+	coro_future_delete(fs[0]);
+	fs[0] = coro_bus_future_new(bus);
+	unit_assert(fs[0] == old && !coro_future_is_set(fs[0]));
+	coro_future_delete(fs[1]);
+	fs[1] = coro_bus_future_new(bus);
+
+	unit_msg("await any");
+	ctx[0].futures = fs;
+	ctx[0].count = 3;
+	ctx[0].is_done = false;
+	workers[0] = coro_new(future_await_any_f, &ctx[0]);
+	ctx[1].futures = fs;
+	ctx[1].count = 3;
+	ctx[1].is_done = false;
+	workers[1] = coro_new(future_await_all_f, &ctx[1]);
+	coro_yield();
+	unit_assert(!ctx[0].is_done && !ctx[1].is_done);
+	unit_assert(coro_future_set(fs[2], 1) == 0);
+	unit_assert(coro_join(workers[0]) == NULL);
+	unit_assert(ctx[0].is_done && ctx[0].result == 2);
+
+	unit_msg("await all");
+	unit_assert(!ctx[1].is_done);
+	unit_assert(coro_future_set(fs[0], 1) == 0);
+	coro_yield();
+	unit_assert(!ctx[1].is_done);
+	unit_assert(coro_future_set(fs[1], 1) == 0);
+	unit_assert(coro_join(workers[1]) == NULL);
+	unit_assert(ctx[1].is_done);
+	unit_assert(coro_future_await_any(fs, 0) == -1);
+
+	unit_msg("await any of many");
+	struct coro_future *many[20];
+	for (int i = 0; i < 20; ++i)
+		many[i] = coro_bus_future_new(bus);
+	ctx[0].futures = many;
+	ctx[0].count = 20;
+	ctx[0].is_done = false;
+	workers[0] = coro_new(future_await_any_f, &ctx[0]);
+	coro_yield();
+	unit_assert(!ctx[0].is_done);
+	unit_assert(coro_future_set(many[17], 1) == 0);
+	unit_assert(coro_join(workers[0]) == NULL);
+	unit_assert(ctx[0].is_done && ctx[0].result == 17);
+	for (int i = 0; i < 20; ++i)
+		coro_future_delete(many[i]);
+
+	for (int i = 0; i < 3; ++i)
+		coro_future_delete(fs[i]);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_pipeline(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	int c1 = coro_bus_channel_open(bus, 10);
+	int c2 = coro_bus_channel_open(bus, 10);
+	int c3 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0 && c2 >= 0 && c3 >= 0);
+	unit_assert(coro_bus_pipeline_new(bus, c1, c3 + 1, 3) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_OLDEST;
+	int c4 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c4 >= 0);
+	unit_assert(coro_bus_pipeline_new(bus, c4, c3, 3) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c4);
+
+	unit_msg("credits limit the head");
+	struct coro_bus_pipeline *p = coro_bus_pipeline_new(bus, c1, c3, 3);
+	unit_assert(p != NULL);
+	unit_assert(coro_bus_pipeline_new(bus, c1, c2, 3) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 3);
+
+	unit_msg("messages in the middle keep the credits");
+	for (unsigned i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+		unit_assert(coro_bus_send(bus, c2, data) == 0);
+	}
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == i);
+		unit_assert(coro_bus_send(bus, c3, data) == 0);
+	}
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 3);
+
+	unit_msg("the tail returns the credits");
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 0);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 3);
+
+	unit_msg("filtered messages are released");
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 3);
+	coro_bus_pipeline_release(p, 1);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 2);
+	unit_assert(coro_bus_try_send(bus, c1, 4) == 0);
+
+	unit_msg("delete frees the head");
+	coro_bus_pipeline_delete(p);
+	for (unsigned i = 0; i < 9; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+
+	unit_msg("closed channels");
+	p = coro_bus_pipeline_new(bus, c2, c3, 1);
+	unit_assert(p != NULL);
+	coro_bus_channel_close(bus, c3);
+	unit_assert(coro_bus_try_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 1) != 0);
+	coro_bus_pipeline_release(p, 1);
+	unit_assert(coro_bus_try_send(bus, c2, 1) == 0);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_pipeline_delete(p);
+
+	unit_msg("expired messages return the credits");
+	opts.overflow = CORO_BUS_OVERFLOW_BLOCK;
+	opts.ttl_usec = 1000;
+	int c5 = coro_bus_channel_open_opts(bus, &opts);
+	int c6 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c5 >= 0 && c6 >= 0);
+	p = coro_bus_pipeline_new(bus, c5, c6, 2);
+	unit_assert(p != NULL);
+	unit_assert(coro_bus_try_send(bus, c5, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c5, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c5, 3) != 0);
+	usleep(2000);
+	unit_assert(coro_bus_try_recv(bus, c5, &data) != 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 0);
+	unit_assert(coro_bus_try_send(bus, c5, 3) == 0);
+	unit_assert(coro_bus_recv(bus, c5, &data) == 0 && data == 3);
+	unit_assert(coro_bus_send(bus, c6, data) == 0);
+	usleep(2000);
+	unit_assert(coro_bus_try_recv(bus, c6, &data) != 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 0);
+	coro_bus_pipeline_delete(p);
+	coro_bus_channel_close(bus, c5);
+	coro_bus_channel_close(bus, c6);
+
+	unit_msg("a lossy tail returns the credits of the dropped");
+	opts.ttl_usec = 0;
+	int c7 = coro_bus_channel_open_opts(bus, &opts);
+	opts.size_limit = 1;
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_NEWEST;
+	int c8 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c7 >= 0 && c8 >= 0);
+	p = coro_bus_pipeline_new(bus, c7, c8, 3);
+	unit_assert(p != NULL);
+	unit_assert(coro_bus_try_send(bus, c7, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c7, 2) == 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 2);
+	for (unsigned i = 1; i <= 2; ++i) {
+		unit_assert(coro_bus_recv(bus, c7, &data) == 0 && data == i);
+		unit_assert(coro_bus_send(bus, c8, data) == 0);
+	}
+	unit_assert(coro_bus_pipeline_in_flight(p) == 1);
+	unit_assert(coro_bus_recv(bus, c8, &data) == 0 && data == 1);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 0);
+	coro_bus_pipeline_delete(p);
+	coro_bus_channel_close(bus, c7);
+	coro_bus_channel_close(bus, c8);
+
+#if NEED_BATCH
+	unit_msg("atomic sender waits for the credits");
+	int c9 = coro_bus_channel_open(bus, 10);
+	int c10 = coro_bus_channel_open(bus, 10);
+	unit_assert(c9 >= 0 && c10 >= 0);
+	p = coro_bus_pipeline_new(bus, c9, c10, 4);
+	unit_assert(p != NULL);
+	unit_assert(coro_bus_try_send(bus, c9, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c9, 2) == 0);
+	unsigned batch[3] = {3, 4, 5};
+	struct ctx_send_v ctx_atomic;
+	send_v_atomic_start(&ctx_atomic, bus, c9, batch, 3);
+	coro_yield();
+	unit_assert(ctx_atomic.is_started && !ctx_atomic.is_done);
+	unit_assert(coro_bus_recv(bus, c9, &data) == 0 && data == 1);
+	unit_assert(coro_bus_send(bus, c10, data) == 0);
+	coro_yield();
+	unit_assert(!ctx_atomic.is_done);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 2);
+	unit_assert(coro_bus_recv(bus, c10, &data) == 0 && data == 1);
+	unit_assert(coro_join(ctx_atomic.worker) == NULL);
+	unit_assert(ctx_atomic.rc == 3);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 4);
+	coro_bus_pipeline_delete(p);
+	coro_bus_channel_close(bus, c9);
+	coro_bus_channel_close(bus, c10);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static bool
+link_double_odd(void *ctx, unsigned *data)
+{
+	unsigned *calls = ctx;
+	++*calls;
+	if (*data % 2 == 0)
+		return false;
+	*data *= 2;
+	return true;
+}
+
+static bool
+link_inc(void *ctx, unsigned *data)
+{
+	(void)ctx;
+	++*data;
+	return true;
+}
+
+static void
+test_channel_link(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned calls = 0;
+	unsigned data = 0;
+
+	unit_msg("bad links");
+	int c1 = coro_bus_channel_open(bus, 10);
+	int c2 = coro_bus_channel_open(bus, 2);
+	int c3 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0 && c2 >= 0 && c3 >= 0);
+	unit_assert(coro_bus_link(bus, c1, c3 + 1, link_inc, NULL) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_link(bus, c1, c1, link_inc, NULL) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+
+	unit_msg("transform and filter");
+	unit_assert(coro_bus_link(bus, c1, c2, link_double_odd, &calls) == 0);
+	unit_assert(coro_bus_link(bus, c2, c1, link_inc, NULL) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+	unit_assert(calls == 3);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("backpressure of the destination");
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c1, 5);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 6);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 10);
+
+	unit_msg("chain");
+	unit_assert(coro_bus_link(bus, c2, c3, link_inc, NULL) == 0);
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(coro_bus_send(bus, c2, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 15);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 8);
+#if NEED_BATCH
+	unsigned batch[3] = {1, 2, 3};
+	unit_assert(coro_bus_send_v(bus, c1, batch, 3) == 3);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 3);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 7);
+	unit_assert(coro_bus_try_send_v_atomic(bus, c1, batch, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+#endif
+
+	unit_msg("unlink");
+	unit_assert(coro_bus_unlink(bus, c1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+
+	unit_msg("closed destination");
+	coro_bus_channel_close(bus, c3);
+	unit_assert(coro_bus_send(bus, c2, 3) == 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 3);
+
+	unit_msg("linked pipeline head takes credits");
+	int c4 = coro_bus_channel_open(bus, 10);
+	int c5 = coro_bus_channel_open(bus, 10);
+	unit_assert(c4 >= 0 && c5 >= 0);
+	struct coro_bus_pipeline *p = coro_bus_pipeline_new(bus, c4, c5, 2);
+	unit_assert(p != NULL);
+	unit_assert(coro_bus_link(bus, c4, c5, link_inc, NULL) == 0);
+	unit_assert(coro_bus_try_send(bus, c4, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c4, 2) == 0);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 2);
+	unit_assert(coro_bus_try_send(bus, c4, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c5, &data) == 0 && data == 2);
+	unit_assert(coro_bus_pipeline_in_flight(p) == 1);
+	unit_assert(coro_bus_try_send(bus, c4, 3) == 0);
+	coro_bus_pipeline_delete(p);
+
+	unit_msg("keyless messages keep their keys equal to data");
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	opts.is_conflating = true;
+	int c6 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c6 >= 0);
+	unit_assert(coro_bus_link(bus, c4, c6, link_inc, NULL) == 0);
+	unit_assert(coro_bus_try_send(bus, c4, 1) == 0);
+	unit_assert(coro_bus_try_send_keyed(bus, c6, 2, 9) == 0);
+	unit_assert(coro_bus_try_recv_keyed(bus, c6, &calls, &data) == 0);
+	unit_assert(calls == 2 && data == 9);
+	unit_assert(coro_bus_try_recv(bus, c6, &data) != 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_batch(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stat st;
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	unit_assert(coro_bus_channel_set_batch(bus, 0, 4, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	opts.is_conflating = true;
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_batch(bus, c1, 4, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("flush by count");
+	c1 = coro_bus_channel_open(bus, 5);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_batch(bus, c1, 3, 0) == 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 0 && st.batched == 2);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.size == 3 && st.batched == 0);
+	for (unsigned i = 1; i <= 3; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+
+	unit_msg("held back messages take space");
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_flush(bus, c1) == 0);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+
+	unit_msg("other sends keep the order");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_ttl(bus, c1, 2, 1000000) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+
+	unit_msg("flush by time");
+	unit_assert(coro_bus_channel_set_batch(bus, c1, 100, 10000) == 0);
+	uint64_t start = coro_bus_time_usec();
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 7);
+	unit_assert(coro_bus_time_usec() >= start + 10000);
+
+	unit_msg("receiver sleeps until the batch is due");
+	struct ctx_recv ctx;
+	recv_start(&ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	uint64_t cpu = cpu_time_usec();
+	start = coro_bus_time_usec();
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(recv_join(&ctx) == 0 && data == 7);
+	uint64_t passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 10000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+
+	unit_msg("disable");
+	unit_assert(coro_bus_send(bus, c1, 8) == 0);
+	unit_assert(coro_bus_channel_set_batch(bus, c1, 0, 0) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_send(bus, c1, 9) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 9);
+
+	unit_msg("close with a pending batch");
+	unit_assert(coro_bus_channel_set_batch(bus, c1, 10, 0) == 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_recv_many {
+	struct coro_bus *bus;
+	int channel;
+	unsigned count;
+	unsigned sum;
+};
+
+static void *
+recv_many_f(void *arg)
+{
+	struct ctx_recv_many *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+		ctx->sum += data;
+	}
+	return NULL;
+}
+
+static void *
+send_burst_f(void *arg)
+{
+	struct ctx_recv_many *ctx = arg;
+	for (unsigned i = 1; i <= ctx->count; ++i)
+		unit_assert(coro_bus_send(ctx->bus, ctx->channel, i) == 0);
+	return NULL;
+}
+
+static void
+test_deferred_wakeups(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stat st;
+	coro_bus_set_deferred_wakeups(bus, true);
+	int c1 = coro_bus_channel_open(bus, 100);
+	unit_assert(c1 >= 0);
+
+	unit_msg("wakeup on yield");
+	struct ctx_recv_many r1 = {bus, c1, 3, 0};
+	struct coro *receiver = coro_new(recv_many_f, &r1);
+	coro_yield();
+	for (unsigned i = 1; i <= 3; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(r1.sum == 0);
+	unit_assert(coro_join(receiver) == NULL);
+	unit_assert(r1.sum == 6);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.recv_blocks == 1);
+
+	unit_msg("wakeup when the sender finishes");
+	struct ctx_recv_many r2 = {bus, c1, 50, 0};
+	struct ctx_recv_many r3 = {bus, c1, 50, 0};
+	struct coro *receiver2 = coro_new(recv_many_f, &r2);
+	struct coro *receiver3 = coro_new(recv_many_f, &r3);
+	coro_yield();
+	struct ctx_recv_many sender = {bus, c1, 100, 0};
+	struct coro *worker = coro_new(send_burst_f, &sender);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(coro_join(receiver2) == NULL);
+	unit_assert(coro_join(receiver3) == NULL);
+	unit_assert(r2.sum + r3.sum == 5050);
+
+	unit_msg("turning off wakes up right away");
+	r1.sum = 0;
+	r1.count = 1;
+	receiver = coro_new(recv_many_f, &r1);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	coro_bus_set_deferred_wakeups(bus, false);
+	unit_assert(coro_join(receiver) == NULL);
+	unit_assert(r1.sum == 7);
+
+	unit_msg("close a marked channel");
+	coro_bus_set_deferred_wakeups(bus, true);
+	unsigned data = 0;
+	struct ctx_recv ctx;
+	recv_start(&ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(recv_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("broadcast wakeup is deferred too");
+	c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+	r1.channel = c1;
+	r1.sum = 0;
+	r1.count = 1;
+	receiver = coro_new(recv_many_f, &r1);
+	coro_yield();
+	unit_assert(coro_bus_try_broadcast(bus, 5) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &st) == 0);
+	unit_assert(st.recv_waiters == 1);
+	unit_assert(coro_join(receiver) == NULL);
+	unit_assert(r1.sum == 5);
+
+	unit_msg("delete a bus with a marked channel");
+	struct coro_bus *bus2 = coro_bus_new();
+	coro_bus_set_deferred_wakeups(bus2, true);
+	int c2 = coro_bus_channel_open(bus2, 10);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus2, c2, 1) == 0);
+	coro_bus_delete(bus2);
+	coro_yield();
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_window(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_window_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	int c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_window(bus, c1 + 1, NULL) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_channel_set_window(bus, c1, &opts) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.period_usec = 1000;
+	opts.slide = 1;
+	unit_assert(coro_bus_channel_set_window(bus, c1, &opts) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+
+	unit_msg("tumbling by count");
+	const enum coro_bus_window_op ops[4] = {CORO_BUS_WINDOW_COUNT,
+		CORO_BUS_WINDOW_SUM, CORO_BUS_WINDOW_MIN, CORO_BUS_WINDOW_MAX};
+	const unsigned expected[4][2] = {{3, 3}, {12, 20}, {3, 2}, {5, 9}};
+	const unsigned input[6] = {4, 3, 5, 9, 2, 9};
+	for (int k = 0; k < 4; ++k) {
+		memset(&opts, 0, sizeof(opts));
+		opts.op = ops[k];
+		opts.size = 3;
+		unit_assert(coro_bus_channel_set_window(bus, c1, &opts) == 0);
+		for (int i = 0; i < 6; ++i)
+			unit_assert(coro_bus_send(bus, c1, input[i]) == 0);
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unit_assert(data == expected[k][0]);
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unit_assert(data == expected[k][1]);
+		unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	}
+
+	unit_msg("removal emits the started window");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_channel_set_window(bus, c1, NULL) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+
+	unit_msg("sliding by count");
+	const unsigned slide_in[7] = {5, 1, 4, 2, 8, 3, 7};
+	const unsigned slide_min[5] = {1, 1, 2, 2, 3};
+	const unsigned slide_max[5] = {5, 4, 8, 8, 8};
+	const unsigned slide_sum[5] = {10, 7, 14, 13, 18};
+	for (int k = 1; k < 4; ++k) {
+		memset(&opts, 0, sizeof(opts));
+		opts.op = ops[k];
+		opts.size = 3;
+		opts.slide = 1;
+		unit_assert(coro_bus_channel_set_window(bus, c1, &opts) == 0);
+		for (int i = 0; i < 7; ++i)
+			unit_assert(coro_bus_send(bus, c1, slide_in[i]) == 0);
+		for (int i = 0; i < 5; ++i) {
+			unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+			if (ops[k] == CORO_BUS_WINDOW_SUM)
+				unit_assert(data == slide_sum[i]);
+			else if (ops[k] == CORO_BUS_WINDOW_MIN)
+				unit_assert(data == slide_min[i]);
+			else
+				unit_assert(data == slide_max[i]);
+		}
+		unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	}
+	opts.op = CORO_BUS_WINDOW_MAX;
+	opts.slide = 2;
+	unit_assert(coro_bus_channel_set_window(bus, c1, &opts) == 0);
+	for (int i = 0; i < 7; ++i)
+		unit_assert(coro_bus_send(bus, c1, slide_in[i]) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	unit_msg("tumbling by time");
+	memset(&opts, 0, sizeof(opts));
+	opts.op = CORO_BUS_WINDOW_SUM;
+	opts.period_usec = 10000;
+	unit_assert(coro_bus_channel_set_window(bus, c1, &opts) == 0);
+	uint64_t start = coro_bus_time_usec();
+	for (unsigned i = 1; i <= 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 10);
+	unit_assert(coro_bus_time_usec() >= start + 10000);
+
+	unit_msg("receiver sleeps until the window ends");
+	struct ctx_recv ctx;
+	recv_start(&ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	uint64_t cpu = cpu_time_usec();
+	start = coro_bus_time_usec();
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(recv_join(&ctx) == 0 && data == 5);
+	uint64_t passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 10000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_merge {
+	struct coro_bus_merge *merge;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+merge_f(void *arg)
+{
+	struct ctx_merge *ctx = arg;
+	ctx->rc = coro_bus_merge_next(ctx->merge, &ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_merge(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int chans[3];
+	for (int i = 0; i < 3; ++i) {
+		chans[i] = coro_bus_channel_open(bus, 100);
+		unit_assert(chans[i] >= 0);
+	}
+	struct coro_bus_merge *m = coro_bus_merge_new(bus, chans, 3);
+	unit_assert(m != NULL);
+	unsigned data = 0;
+
+	unit_msg("waits for all the inputs");
+	unit_assert(coro_bus_send(bus, chans[0], 1) == 0);
+	unit_assert(coro_bus_send(bus, chans[1], 2) == 0);
+	unit_assert(coro_bus_merge_try_next(m, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_send(bus, chans[2], 0) == 0);
+	unit_assert(coro_bus_merge_try_next(m, &data) == 0 && data == 0);
+	unit_assert(coro_bus_merge_try_next(m, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("ordered fan-in");
+	const unsigned in[3][4] = {{3, 7, 8, 20}, {2, 9, 10, 11}, {4, 5, 6, 30}};
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 4; ++j)
+			unit_assert(coro_bus_send(bus, chans[i], in[i][j]) == 0);
+	}
+	const unsigned expected[] = {1, 2, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		unit_assert(coro_bus_merge_try_next(m, &data) == 0);
+		unit_assert(data == expected[i]);
+	}
+	/* The second input is exhausted. */
+	unit_assert(coro_bus_merge_try_next(m, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("blocking wait for an empty input");
+	struct ctx_merge ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.merge = m;
+	struct coro *worker = coro_new(merge_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, chans[1], 25) == 0);
+	coro_yield();
+	unit_assert(ctx.is_done && ctx.rc == 0 && ctx.data == 20);
+	unit_assert(coro_join(worker) == NULL);
+
+	unit_msg("closed inputs are skipped");
+	ctx.is_done = false;
+	worker = coro_new(merge_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, chans[0]);
+	coro_yield();
+	unit_assert(ctx.is_done && ctx.rc == 0 && ctx.data == 25);
+	unit_assert(coro_join(worker) == NULL);
+	coro_bus_channel_close(bus, chans[1]);
+	unit_assert(coro_bus_merge_try_next(m, &data) == 0 && data == 30);
+	coro_bus_channel_close(bus, chans[2]);
+	unit_assert(coro_bus_merge_next(m, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_merge_delete(m);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_match {
+	struct coro_bus *bus;
+	int channel;
+	unsigned key;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+match_f(void *arg)
+{
+	struct ctx_match *ctx = arg;
+	ctx->rc = coro_bus_recv_match(ctx->bus, ctx->channel, ctx->key,
+		&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_recv_match(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	unsigned key = 0;
+	unsigned data = 0;
+
+	unit_msg("only matching channels");
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_try_recv_match(bus, c1 + 1, 1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, c1);
+	opts.is_matching = true;
+	opts.is_conflating = true;
+	unit_assert(coro_bus_channel_open_opts(bus, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.is_conflating = false;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+
+	unit_msg("takes from the middle");
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 10) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 2, 20) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 11) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 2, 21) == 0);
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 3, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 2, &data) == 0);
+	unit_assert(data == 20);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 7, &data) == 0);
+	unit_assert(data == 7);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 2, &data) == 0);
+	unit_assert(data == 21);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("plain receive keeps the index");
+	unit_assert(coro_bus_try_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 1 && data == 10);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 1, &data) == 0);
+	unit_assert(data == 11);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 1, &data) != 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	unit_msg("waiters are woken per key");
+	struct ctx_match ctx[2];
+	struct coro *workers[2];
+	for (int i = 0; i < 2; ++i) {
+		memset(&ctx[i], 0, sizeof(ctx[i]));
+		ctx[i].bus = bus;
+		ctx[i].channel = c1;
+		ctx[i].key = 100 + i;
+		workers[i] = coro_new(match_f, &ctx[i]);
+	}
+	coro_yield();
+	struct coro_bus_channel_stat stat;
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.recv_waiters == 2);
+	unit_assert(coro_bus_send_keyed(bus, c1, 101, 5) == 0);
+	coro_yield();
+	unit_assert(!ctx[0].is_done);
+	unit_assert(ctx[1].is_done && ctx[1].rc == 0 && ctx[1].data == 5);
+	unit_assert(coro_join(workers[1]) == NULL);
+
+#if NEED_BATCH
+	unit_msg("drain keeps the waiters");
+	memset(&ctx[1], 0, sizeof(ctx[1]));
+	ctx[1].bus = bus;
+	ctx[1].channel = c1;
+	ctx[1].key = 102;
+	workers[1] = coro_new(match_f, &ctx[1]);
+	coro_yield();
+	unit_assert(coro_bus_send_keyed(bus, c1, 3, 30) == 0);
+	struct coro_bus_buffer buf = {NULL, 0, 0};
+	unit_assert(coro_bus_drain_swap(bus, c1, &buf) == 1);
+	free(buf.data);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 3, &data) != 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 102, 6) == 0);
+	unit_assert(coro_join(workers[1]) == NULL);
+	unit_assert(ctx[1].rc == 0 && ctx[1].data == 6);
+	unit_assert(!ctx[0].is_done);
+#endif
+
+	unit_msg("close wakes the waiters");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(workers[0]) == NULL);
+	unit_assert(ctx[0].rc != 0 && ctx[0].err == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("messages expired in the middle are skipped");
+	opts.size_limit = 3;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 9, 90) == 0);
+	unit_assert(coro_bus_try_send_ttl(bus, c1, 5, 1000) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 5, 50) == 0);
+	usleep(2000);
+	unit_assert(coro_bus_try_send_keyed(bus, c1, 5, 51) == 0);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 5, &data) == 0);
+	unit_assert(data == 50);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 5, &data) == 0);
+	unit_assert(data == 51);
+	unit_assert(coro_bus_try_recv_match(bus, c1, 5, &data) != 0);
+	unit_assert(coro_bus_try_recv_keyed(bus, c1, &key, &data) == 0);
+	unit_assert(key == 9 && data == 90);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_rate(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	int c1 = coro_bus_channel_open(bus, 100);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_rate(bus, c1 + 1, 1000, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_channel_set_rate(bus, c1, 1000, UINT64_MAX) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+
+	unit_msg("burst is taken at once");
+	unit_assert(coro_bus_channel_set_rate(bus, c1, 1000, 3) == 0);
+	for (unsigned i = 0; i < 10; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("receivers wait for the tokens");
+	uint64_t start = coro_bus_time_usec();
+	for (unsigned i = 3; i < 8; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+	unit_assert(coro_bus_time_usec() >= start + 4000);
+
+	unit_msg("receivers sleep for the tokens");
+	unit_assert(coro_bus_channel_set_rate(bus, c1, 50, 1) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 8);
+	uint64_t cpu = cpu_time_usec();
+	start = coro_bus_time_usec();
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 9);
+	uint64_t passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 15000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+	for (unsigned i = 0; i < 2; ++i)
+		unit_assert(coro_bus_send(bus, c1, 8 + i) == 0);
+
+	unit_msg("removal frees the messages");
+	unit_assert(coro_bus_channel_set_rate(bus, c1, 0, 0) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 9);
+
+#if NEED_BATCH
+	unit_msg("vector receive takes only the tokens");
+	unsigned out[10];
+	unit_assert(coro_bus_channel_set_rate(bus, c1, 1000, 2) == 0);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_recv_v(bus, c1, out, 10) == 2);
+	unit_assert(coro_bus_try_recv_v(bus, c1, out, 10) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_dedup(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stat stat;
+	unsigned data = 0;
+
+	unit_msg("bad settings");
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_set_dedup(bus, c1 + 1, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("recent keys are dropped");
+	unit_assert(coro_bus_channel_set_dedup(bus, c1, 2) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 10) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 11) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 2, 20) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.size == 2 && stat.deduplicated == 2);
+
+	unit_msg("duplicates do not need space");
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_try_send_keyed(bus, c1, 2, 21) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 6) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 10);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 20);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+
+	unit_msg("old keys are forgotten");
+	/* The filter remembers 2 and 5 now, then 1 pushes 2 out. */
+	unit_assert(coro_bus_send_keyed(bus, c1, 5, 50) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 1, 12) == 0);
+	unit_assert(coro_bus_send_keyed(bus, c1, 2, 22) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 12);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 22);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+#if NEED_BATCH
+	unit_msg("vector with duplicates");
+	const unsigned vec[5] = {7, 7, 8, 1, 8};
+	unit_assert(coro_bus_try_send_v(bus, c1, vec, 3) == 3);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 7);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 8);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+#endif
+
+	unit_msg("turned off");
+	unit_assert(coro_bus_channel_set_dedup(bus, c1, 0) == 0);
+	unit_assert(coro_bus_send(bus, c1, 8) == 0);
+	unit_assert(coro_bus_send(bus, c1, 8) == 0);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.size == 2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_ack {
+	struct coro_bus *bus;
+	int channel;
+	unsigned data;
+	uint64_t tag;
+};
+
+static void *
+ack_consumer_f(void *arg)
+{
+	/* Takes a message and dies without acknowledging it. */
+	struct ctx_ack *ctx = arg;
+	unit_assert(coro_bus_recv_ack(ctx->bus, ctx->channel, &ctx->data,
+		&ctx->tag) == 0);
+	return NULL;
+}
+
+static void
+test_channel_ack(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 3;
+	struct coro_bus_channel_stat stat;
+	unsigned data = 0;
+	uint64_t tag = 0;
+	uint64_t tags[3];
+
+	unit_msg("only in the ack mode");
+	int c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tag) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	unit_assert(coro_bus_ack(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	coro_bus_channel_close(bus, c1);
+	opts.is_acked = true;
+	opts.is_conflating = true;
+	unit_assert(coro_bus_channel_open_opts(bus, &opts) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NOT_IMPLEMENTED);
+	opts.is_conflating = false;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+
+	unit_msg("messages in flight take space");
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	for (unsigned i = 0; i < 3; ++i) {
+		unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tags[i]) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(tags[0] < tags[1] && tags[1] < tags[2]);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.size == 0 && stat.in_flight == 3);
+
+	unit_msg("individual and cumulative acks");
+	unit_assert(coro_bus_ack(bus, c1, tags[1]) == 0);
+	unit_assert(coro_bus_ack(bus, c1, tags[1]) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_ack_upto(bus, c1, tags[2]) == 2);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.in_flight == 0);
+
+	unit_msg("cancelled consumer gives the messages back");
+	struct ctx_ack ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	struct coro *consumer = coro_new(ack_consumer_f, &ctx);
+	coro_yield();
+	coro_yield();
+	unit_assert(ctx.data == 3);
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(coro_bus_nack_all(bus, c1, consumer) == 1);
+	unit_assert(coro_join(consumer) == NULL);
+	unit_assert(coro_bus_ack(bus, c1, ctx.tag) != 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tag) == 0);
+	unit_assert(data == 3 && tag > ctx.tag);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 4);
+	unit_assert(coro_bus_ack(bus, c1, tag) == 0);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("timed out messages are delivered again");
+	opts.ack_timeout_usec = 2000;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tag) == 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tag) != 0);
+	uint64_t start = coro_bus_time_usec();
+	unit_assert(coro_bus_recv_ack(bus, c1, &data, &tag) == 0);
+	unit_assert(data == 5);
+	unit_assert(coro_bus_time_usec() >= start + 1000);
+	unit_assert(coro_bus_ack(bus, c1, tag) == 0);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("receiver sleeps until the message in flight is due");
+	opts.ack_timeout_usec = 20000;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	struct ctx_recv ctx_wait;
+	recv_start(&ctx_wait, bus, c1, &data);
+	coro_yield();
+	unit_assert(ctx_wait.is_started && !ctx_wait.is_done);
+	uint64_t cpu = cpu_time_usec();
+	start = coro_bus_time_usec();
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tag) == 0);
+	unit_assert(recv_join(&ctx_wait) == 0 && data == 6);
+	uint64_t passed = coro_bus_time_usec() - start;
+	unit_assert(passed >= 20000);
+	unit_assert(cpu_time_usec() - cpu < passed / 2);
+	coro_bus_channel_close(bus, c1);
+
+#if NEED_BATCH
+	unit_msg("atomic sender counts the messages in flight");
+	opts.size_limit = 4;
+	opts.ack_timeout_usec = 0;
+	c1 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tags[0]) == 0);
+	unit_assert(coro_bus_try_recv_ack(bus, c1, &data, &tags[1]) == 0);
+	unsigned batch[3] = {10, 11, 12};
+	struct ctx_send_v ctx_atomic;
+	send_v_atomic_start(&ctx_atomic, bus, c1, batch, 3);
+	coro_yield();
+	unit_assert(ctx_atomic.is_started && !ctx_atomic.is_done);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 2);
+	coro_yield();
+	unit_assert(!ctx_atomic.is_done);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.size == 0 && stat.in_flight == 2);
+	unit_assert(coro_bus_ack(bus, c1, tags[0]) == 0);
+	unit_assert(coro_join(ctx_atomic.worker) == NULL);
+	unit_assert(ctx_atomic.rc == 3);
+	unit_assert(coro_bus_channel_stat(bus, c1, &stat) == 0);
+	unit_assert(stat.size == 3 && stat.in_flight == 1);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_bus_budget(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("usage of all the channels");
+	int c1 = coro_bus_channel_open(bus, 10);
+	int c2 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0 && c2 >= 0);
+	unit_assert(coro_bus_usage(bus) == 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_usage(bus) == 2);
+
+	unit_msg("sends beyond the budget fail");
+	coro_bus_set_budget(bus, 3);
+	unit_assert(coro_bus_try_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_BUDGET);
+	unit_assert(coro_bus_usage(bus) == 3);
+
+	unit_msg("sends beyond the budget wait");
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c2, 4);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	/* It waits for the bus, not for the channel. */
+	struct coro_bus_channel_stat st;
+	unit_assert(coro_bus_channel_stat(bus, c2, &st) == 0);
+	unit_assert(st.send_waiters == 0 && st.send_blocks == 1);
+	/* A receive from another channel frees the budget. */
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_usage(bus) == 3);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast takes budget of all the channels");
+	unit_assert(coro_bus_try_broadcast(bus, 9) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_BUDGET);
+	coro_bus_set_budget(bus, 4);
+	unit_assert(coro_bus_try_broadcast(bus, 9) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_BUDGET);
+	coro_bus_set_budget(bus, 5);
+	unit_assert(coro_bus_try_broadcast(bus, 9) == 0);
+	unit_assert(coro_bus_usage(bus) == 5);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 3);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 9);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 4);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 9);
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(coro_bus_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_send(bus, c2, 4) == 0);
+	coro_bus_set_budget(bus, 3);
+#endif
+
+	unit_msg("closed channel frees the budget");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_usage(bus) == 2);
+	unit_assert(coro_bus_try_send(bus, c2, 5) == 0);
+
+	unit_msg("lossy channel drops beyond the budget");
+	struct coro_bus_channel_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.size_limit = 10;
+	opts.overflow = CORO_BUS_OVERFLOW_DROP_NEWEST;
+	int c3 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_try_send(bus, c3, 6) == 0);
+	struct coro_bus_channel_stat stat;
+	unit_assert(coro_bus_channel_stat(bus, c3, &stat) == 0);
+	unit_assert(stat.size == 0 && stat.dropped == 1);
+
+	unit_msg("lossy conflating channel drops beyond the budget");
+	opts.is_conflating = true;
+	int c4 = coro_bus_channel_open_opts(bus, &opts);
+	unit_assert(c4 >= 0);
+	coro_bus_set_budget(bus, 4);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_try_send(bus, c4, i) == 0);
+	unit_assert(coro_bus_usage(bus) == 4);
+	unit_assert(coro_bus_channel_stat(bus, c4, &stat) == 0);
+	unit_assert(stat.size == 1 && stat.dropped == 4);
+	coro_bus_channel_close(bus, c4);
+	coro_bus_set_budget(bus, 3);
+
+	unit_msg("removed budget");
+	coro_bus_set_budget(bus, 0);
+	unit_assert(coro_bus_try_send(bus, c3, 7) == 0);
+	unit_assert(coro_bus_usage(bus) == 4);
+	coro_bus_set_budget(bus, 1);
+	coro_bus_delete(bus);
+
+	unit_msg("new bus has no budget");
+	bus = coro_bus_new();
+	unit_assert(coro_bus_usage(bus) == 0);
+	c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_usage(bus) == 5);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1610,6 +4136,8 @@ coro_main_f(void *arg)
 	test_basic();
 	test_channel_reopen();
 	test_multiple_channels();
+	test_channel_stat();
+	test_channel_set_limit();
 
 	test_send_basic();
 	test_send_blocking();
@@ -1631,10 +4159,34 @@ coro_main_f(void *arg)
 	test_send_vector_basic();
 	test_send_vector_blocking();
 	test_send_vector_blocking_recv_many();
+	test_send_vector_atomic_basic();
+	test_send_vector_atomic_blocking();
 
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+	test_drain_swap();
+	test_channel_adaptive_limit();
+	test_channel_overflow();
+	test_channel_conflating();
+	test_channel_priority();
+	test_channel_ttl();
+	test_send_at();
+	test_partition();
+	test_dispatcher();
+	test_call();
+	test_future();
+	test_pipeline();
+	test_channel_link();
+	test_channel_batch();
+	test_deferred_wakeups();
+	test_channel_window();
+	test_merge();
+	test_recv_match();
+	test_channel_rate();
+	test_channel_dedup();
+	test_channel_ack();
+	test_bus_budget();
 	return NULL;
 }
 